@@ -4,8 +4,251 @@
 #include <vmlinux.h>
 #include <bpf/bpf_helpers.h>
 #include <bpf/bpf_tracing.h>
+#include <bpf/bpf_core_read.h>
 #include "insn.h"
 
+/**
+  CONFIGURATION: set by userspace before the program is loaded. These are
+  constants to the verifier, so branches for unused features are removed.
+**/
+
+/* How many bytes to read at each sampled IP. Up to 15 on x86, 4 on arm64. */
+const volatile __u32 fetch_len = 15;
+
+/* If false, userspace already knows the names of the processes it wants */
+const volatile bool capture_comm = true;
+
+/* Whether to send each process's cgroup along with its name */
+const volatile bool capture_cgroup = false;
+
+/* Whether to count each thread separately, instead of each process */
+const volatile bool per_thread = false;
+
+/* Never sample this process (processwatch itself), if nonzero */
+const volatile __u32 self_tgid = 0;
+
+/* Don't sample kernel threads, which never run user code */
+const volatile bool exclude_kthreads = false;
+
+/* Only sample the processes in `allowed_tgids`, or whose names start
+   with one of the first `num_comm_prefixes` in `comm_prefixes`. If
+   both are given, a process only has to match one. */
+const volatile bool filter_tgids = false;
+const volatile __u32 num_comm_prefixes = 0;
+
+struct {
+  __uint(type, BPF_MAP_TYPE_HASH);
+  __uint(max_entries, MAX_FILTER_PIDS);
+  __type(key, __u32);
+  __type(value, __u8);
+} allowed_tgids SEC(".maps");
+
+struct {
+  __uint(type, BPF_MAP_TYPE_ARRAY);
+  __uint(max_entries, MAX_COMM_PREFIXES);
+  __type(key, __u32);
+  __type(value, struct comm_prefix);
+} comm_prefixes SEC(".maps");
+
+#define PF_KTHREAD 0x00200000
+
+static __always_inline int match_comm_prefix() {
+  struct comm_prefix *prefix;
+  __u64 words[TASK_COMM_LEN / 8];
+  u32 i;
+  
+  bpf_get_current_comm(words, sizeof(words));
+  for(i = 0; i < MAX_COMM_PREFIXES; i++) {
+    if(i >= num_comm_prefixes) {
+      break;
+    }
+    prefix = bpf_map_lookup_elem(&comm_prefixes, &i);
+    if(!prefix) {
+      break;
+    }
+    if(((words[0] & prefix->mask[0]) == prefix->prefix[0]) &&
+       ((words[1] & prefix->mask[1]) == prefix->prefix[1])) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+  skip_task: Returns 1 if the current task's samples should be dropped
+  before they cost any ringbuffer space.
+**/
+static __always_inline int skip_task(u32 tgid) {
+  struct task_struct *task;
+  unsigned int flags;
+  
+  if(self_tgid && (tgid == self_tgid)) {
+    return 1;
+  }
+  
+  if(exclude_kthreads) {
+    task = (struct task_struct *) bpf_get_current_task();
+    if(bpf_core_read(&flags, sizeof(flags), &task->flags) || (flags & PF_KTHREAD)) {
+      return 1;
+    }
+  }
+  
+  if(!filter_tgids && !num_comm_prefixes) {
+    return 0;
+  }
+  if(filter_tgids && bpf_map_lookup_elem(&allowed_tgids, &tgid)) {
+    return 0;
+  }
+  if(num_comm_prefixes && match_comm_prefix()) {
+    return 0;
+  }
+  return 1;
+}
+
+/**
+  fetch_insn: Reads the instruction at `ip`. The length is clamped so
+  that the verifier can see that it fits.
+**/
+static __always_inline long fetch_insn(unsigned char *insn, u64 ip) {
+  u32 len = fetch_len;
+  
+  if(len > 15) {
+    len = 15;
+  }
+  return bpf_probe_read_user(insn, len, (void *) ip);
+}
+
+/**
+  PROCESS NAMES: to keep samples small, we only send a process's
+  name when we first see it, or when it changes (e.g. on exec).
+**/
+
+struct seen_comm {
+  union {
+    char  name[TASK_COMM_LEN];
+    __u64 words[TASK_COMM_LEN / 8];
+  };
+  union {
+    char  thread_name[TASK_COMM_LEN];
+    __u64 thread_words[TASK_COMM_LEN / 8];
+  };
+  __u64 cgroup_id;
+  
+  /* When the name was sent. Not compared by comm_changed. */
+  __u64 gen;
+};
+
+struct {
+  __uint(type, BPF_MAP_TYPE_LRU_HASH);
+  __uint(max_entries, SEEN_MAX_ENTRIES);
+  __type(key, __u32);
+  __type(value, struct seen_comm);
+} seen SEC(".maps");
+
+/**
+  comm_changed: Reads the current process's name (and thread name, and
+  cgroup) into `comm`. The process's name is its thread group leader's,
+  since bpf_get_current_comm returns the thread's. Returns 1 if userspace
+  hasn't been sent them for this key (a PID, or a TID if per_thread) yet.
+**/
+static __always_inline int comm_changed(u32 key, struct seen_comm *comm) {
+  struct seen_comm *seen_comm;
+  struct task_struct *task;
+  
+  __builtin_memset(comm, 0, sizeof(*comm));
+  task = (struct task_struct *) bpf_get_current_task();
+  task = BPF_CORE_READ(task, group_leader);
+  if(bpf_core_read(comm->name, sizeof(comm->name), &task->comm)) {
+    bpf_get_current_comm(comm->name, sizeof(comm->name));
+  }
+  if(per_thread) {
+    bpf_get_current_comm(comm->thread_name, sizeof(comm->thread_name));
+  }
+  if(capture_cgroup) {
+    comm->cgroup_id = bpf_get_current_cgroup_id();
+  }
+  
+  seen_comm = bpf_map_lookup_elem(&seen, &key);
+  if(!seen_comm) {
+    return 1;
+  }
+  return (seen_comm->words[0] != comm->words[0]) ||
+         (seen_comm->words[1] != comm->words[1]) ||
+         (seen_comm->thread_words[0] != comm->thread_words[0]) ||
+         (seen_comm->thread_words[1] != comm->thread_words[1]) ||
+         (seen_comm->cgroup_id != comm->cgroup_id);
+}
+
+/**
+  STATS: counts each sample that we couldn't record, by reason.
+**/
+
+struct {
+  __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+  __uint(max_entries, 1);
+  __type(key, __u32);
+  __type(value, struct insn_stats);
+} stats SEC(".maps");
+
+static __always_inline struct insn_stats *get_stats() {
+  u32 zero = 0;
+  
+  return bpf_map_lookup_elem(&stats, &zero);
+}
+
+/* The map is per-CPU, so there's no need for atomics */
+#define count_stat(stats_ptr, field) \
+  if(stats_ptr) { \
+    (stats_ptr)->field++; \
+  }
+
+static __always_inline u64 sample_ip(struct bpf_perf_event_data *ctx) {
+#ifdef __TARGET_ARCH_arm
+  return ctx->regs.pc;
+#else
+  return ctx->regs.ip;
+#endif
+}
+
+/* Kernel addresses are in the upper half on both x86_64 and arm64 */
+static __always_inline int is_kernel_ip(u64 ip) {
+  return (s64) ip < 0;
+}
+
+/**
+  PROCESS LIFECYCLE: when a process that userspace knows about exits or
+  execs, tell it which one, so that it can free it. Forgetting the PID in
+  `seen` also makes sure that its next user's name is sent.
+**/
+
+/**
+  lifecycle_key: The `seen` key that the current task's exit or exec
+  affects, or 0 if it doesn't affect any. Without per_thread, an exit
+  only ends the process if it's the last thread's. That isn't always
+  the leader's, which can pthread_exit and leave the others running.
+  The exiting thread has already been taken off the group's count of
+  live threads by the time the tracepoint fires.
+**/
+static __always_inline u32 lifecycle_key(bool exiting) {
+  struct task_struct *task;
+  
+  u64 pid_tgid = bpf_get_current_pid_tgid();
+  u32 pid = pid_tgid >> 32;
+  u32 tid = (u32) pid_tgid;
+  
+  if(per_thread) {
+    return tid;
+  }
+  if(!exiting) {
+    return pid;
+  }
+  task = (struct task_struct *) bpf_get_current_task();
+  if(BPF_CORE_READ(task, signal, live.counter) != 0) {
+    return 0;
+  }
+  return pid;
+}
+
 #ifdef INSNPROF_LEGACY_PERF_BUFFER
 
 /**
@@ -18,34 +261,114 @@ struct {
   __uint(value_size, sizeof(int));
 } pb SEC(".maps");
 
+static __always_inline long output_record(struct bpf_perf_event_data *ctx, void *data, u64 size) {
+  u32 cpu;
+  
+#ifdef BPF_F_CURRENT_CPU
+  return bpf_perf_event_output(ctx, &pb, BPF_F_CURRENT_CPU, data, size);
+#else
+  cpu = bpf_get_smp_processor_id();
+  return bpf_perf_event_output(ctx, &pb, cpu, data, size);
+#endif
+}
+
 SEC("perf_event")
 int insn_collect(struct bpf_perf_event_data *ctx) {
-  u32 cpu;
   struct insn_info insn_info = {};
+  struct comm_info comm_info = {};
+  struct seen_comm comm;
+  struct insn_stats *stats_ptr;
   long retval;
+  u64 ip;
   
-  /* Construct the insn_info struct */
   u64 pid_tgid = bpf_get_current_pid_tgid();
   u32 pid = pid_tgid >> 32;
+  u32 tid = (u32) pid_tgid;
+  u32 key = per_thread ? tid : pid;
+  
+  /* Filtered-out processes aren't counted at all */
+  if(skip_task(pid)) {
+    return 0;
+  }
+  
+  stats_ptr = get_stats();
+  count_stat(stats_ptr, samples);
+  
+  /* Construct the insn_info struct */
   insn_info.pid = pid;
+  insn_info.tid = tid;
+  insn_info.type = RECORD_SAMPLE;
 
-  retval = bpf_probe_read_user(insn_info.insn, 15, (void *) ctx->regs.ip);
+  ip = sample_ip(ctx);
+  if(is_kernel_ip(ip)) {
+    count_stat(stats_ptr, kernel);
+    return 0;
+  }
+  retval = fetch_insn(insn_info.insn, ip);
   if(retval < 0) {
+    count_stat(stats_ptr, fetch_failed);
     return 0;
   }
-  bpf_get_current_comm(insn_info.name, sizeof(insn_info.name));
+  
+  /* Send the name first, if it's new. If that fails, we'll try again
+     on the next sample. */
+  if(capture_comm && comm_changed(key, &comm)) {
+    comm.gen = bpf_ktime_get_ns();
+    comm_info.pid = pid;
+    comm_info.tid = tid;
+    comm_info.type = RECORD_COMM;
+    __builtin_memcpy(comm_info.name, comm.name, TASK_COMM_LEN);
+    __builtin_memcpy(comm_info.thread_name, comm.thread_name, TASK_COMM_LEN);
+    comm_info.cgroup_id = comm.cgroup_id;
+    comm_info.gen = comm.gen;
+    if(output_record(ctx, &comm_info, sizeof(struct comm_info)) == 0) {
+      bpf_map_update_elem(&seen, &key, &comm, BPF_ANY);
+    }
+  }
   
   /* Place insn_info in the ringbuf */
-#ifdef BPF_F_CURRENT_CPU
-  bpf_perf_event_output(ctx, &pb, BPF_F_CURRENT_CPU, &insn_info, sizeof(struct insn_info));
-#else
-  cpu = bpf_get_smp_processor_id();
-  bpf_perf_event_output(ctx, &pb, cpu, &insn_info, sizeof(struct insn_info));
-#endif
+  if(output_record(ctx, &insn_info, sizeof(struct insn_info)) != 0) {
+    count_stat(stats_ptr, lost);
+  }
   
   return 0;
 }
 
+/**
+  emit_exit: Sends a RECORD_EXIT for the process (or thread) that userspace
+  knows as `key`, if it knows about it at all. `key` isn't always the
+  current task's, so it's sent as both the PID and the TID. The key is
+  only forgotten once userspace has been told.
+**/
+static __always_inline void emit_exit(void *ctx, u32 key) {
+  struct comm_info comm_info = {};
+  struct insn_stats *stats_ptr;
+  struct seen_comm *comm;
+  
+  if(!key) {
+    return;
+  }
+  comm = bpf_map_lookup_elem(&seen, &key);
+  if(!comm) {
+    return;
+  }
+  
+  comm_info.pid = key;
+  comm_info.tid = key;
+  comm_info.type = RECORD_EXIT;
+  __builtin_memcpy(comm_info.name, comm->name, TASK_COMM_LEN);
+  __builtin_memcpy(comm_info.thread_name, comm->thread_name, TASK_COMM_LEN);
+  comm_info.cgroup_id = comm->cgroup_id;
+  comm_info.gen = comm->gen;
+  if(output_record(ctx, &comm_info, sizeof(struct comm_info)) != 0) {
+    stats_ptr = get_stats();
+    count_stat(stats_ptr, lost_exits);
+    return;
+  }
+  
+  bpf_map_delete_elem(&seen, &key);
+}
+
 #else
 
 /**
@@ -57,39 +380,296 @@ struct {
   __uint(max_entries, MAX_ENTRIES);
 } rb SEC(".maps");
 
+/**
+  SHARDED RINGBUFFERS: one ringbuffer per CPU, or per group of CPUs.
+  The outer map is indexed by CPU; userspace creates the shards and
+  points each CPU's slot at the shard for its group.
+**/
+
+struct ringbuf_shard {
+  __uint(type, BPF_MAP_TYPE_RINGBUF);
+  __uint(max_entries, MAX_ENTRIES);
+};
+
+struct {
+  __uint(type, BPF_MAP_TYPE_ARRAY_OF_MAPS);
+  __uint(max_entries, 1);
+  __type(key, __u32);
+  __array(values, struct ringbuf_shard);
+} rb_shards SEC(".maps");
+
+/* Set by userspace before the program is loaded */
+const volatile bool sharded = false;
+
+/* Userspace is only woken up once this much data is waiting in a
+   ringbuffer, so that it can sleep when samples are sparse and still
+   drain bursts right away. Otherwise, it reads each interval. */
+const volatile __u64 wakeup_bytes = 0;
+
+static __always_inline __u64 wakeup_flags(void *ringbuf) {
+  if(bpf_ringbuf_query(ringbuf, BPF_RB_AVAIL_DATA) >= wakeup_bytes) {
+    return BPF_RB_FORCE_WAKEUP;
+  }
+  return BPF_RB_NO_WAKEUP;
+}
+
+/**
+  AGGREGATION INTERFACE: instead of streaming each sample through the
+  ringbuffer, count (process, instruction) pairs per-CPU. Userspace
+  drains this map once per interval.
+**/
+
+struct {
+  __uint(type, BPF_MAP_TYPE_PERCPU_HASH);
+  __uint(max_entries, AGG_MAX_ENTRIES);
+  __type(key, struct insn_agg_key);
+  __type(value, __u64);
+} agg SEC(".maps");
+
+/* Set by userspace before the program is loaded */
+const volatile bool aggregate = false;
+
+static __always_inline int insn_aggregate(struct bpf_perf_event_data *ctx, u32 key_pid,
+                                          u64 ip, struct insn_stats *stats_ptr) {
+  struct insn_agg_key key;
+  __u64 one = 1, *count;
+  long retval;
+  
+  __builtin_memset(&key, 0, sizeof(key));
+  key.pid = key_pid;
+
+  retval = fetch_insn(key.insn, ip);
+  if(retval < 0) {
+    count_stat(stats_ptr, fetch_failed);
+    return 1;
+  }
+  
+  /* The map is per-CPU, so there's no need for an atomic increment */
+  count = bpf_map_lookup_elem(&agg, &key);
+  if(count) {
+    (*count)++;
+  } else if(bpf_map_update_elem(&agg, &key, &one, BPF_NOEXIST) != 0) {
+    count_stat(stats_ptr, lost);
+  }
+  
+  return 0;
+}
+
+/**
+  emit_comm: Sends the current task's name, if it's new. If there's no
+  room in the ringbuffer, we don't mark it as seen, so that we try again
+  on the next sample.
+**/
+static __always_inline void emit_comm(void *ringbuf, u32 pid, u32 tid, u32 key) {
+  struct comm_info *comm_info;
+  struct seen_comm comm;
+  
+  if(!capture_comm || !comm_changed(key, &comm)) {
+    return;
+  }
+  
+  comm_info = bpf_ringbuf_reserve(ringbuf, sizeof(struct comm_info), 0);
+  if(!comm_info) {
+    return;
+  }
+  comm.gen = bpf_ktime_get_ns();
+  comm_info->pid = pid;
+  comm_info->tid = tid;
+  comm_info->type = RECORD_COMM;
+  __builtin_memcpy(comm_info->name, comm.name, TASK_COMM_LEN);
+  __builtin_memcpy(comm_info->thread_name, comm.thread_name, TASK_COMM_LEN);
+  comm_info->cgroup_id = comm.cgroup_id;
+  comm_info->gen = comm.gen;
+  bpf_ringbuf_submit(comm_info, wakeup_flags(ringbuf));
+  
+  bpf_map_update_elem(&seen, &key, &comm, BPF_ANY);
+}
+
 SEC("perf_event")
 int insn_collect(struct bpf_perf_event_data *ctx) {
   struct insn_info *insn_info;
-  long retval = 0;
+  struct insn_stats *stats_ptr;
+  void *ringbuf;
+  long retval;
+  u32 cpu;
+  u64 ip;
+  
+  u64 pid_tgid = bpf_get_current_pid_tgid();
+  u32 pid = pid_tgid >> 32;
+  u32 tid = (u32) pid_tgid;
+  u32 key = per_thread ? tid : pid;
+  
+  /* Filtered-out processes aren't counted at all */
+  if(skip_task(pid)) {
+    return 0;
+  }
+  
+  stats_ptr = get_stats();
+  count_stat(stats_ptr, samples);
+  
+  /* We can't read kernel instructions, so don't bother trying */
+  ip = sample_ip(ctx);
+  if(is_kernel_ip(ip)) {
+    count_stat(stats_ptr, kernel);
+    return 0;
+  }
+  
+  /* Choose this CPU's shard, if any */
+  ringbuf = &rb;
+  if(sharded) {
+    cpu = bpf_get_smp_processor_id();
+    ringbuf = bpf_map_lookup_elem(&rb_shards, &cpu);
+    if(!ringbuf) {
+      count_stat(stats_ptr, lost);
+      return 1;
+    }
+  }
+  
+  emit_comm(ringbuf, pid, tid, key);
+  
+  if(aggregate) {
+    return insn_aggregate(ctx, key, ip, stats_ptr);
+  }
   
   /* Reserve space for this entry */
-  insn_info = bpf_ringbuf_reserve(&rb, sizeof(struct insn_info), 0);
+  insn_info = bpf_ringbuf_reserve(ringbuf, sizeof(struct insn_info), 0);
   if(!insn_info) {
+    count_stat(stats_ptr, lost);
     return 1;
   }
   
   /* Construct the insn_info struct */
-  u64 pid_tgid = bpf_get_current_pid_tgid();
-  u32 pid = pid_tgid >> 32;
   insn_info->pid = pid;
+  insn_info->tid = tid;
+  insn_info->type = RECORD_SAMPLE;
 
-#ifdef __TARGET_ARCH_arm
-  retval = bpf_probe_read_user(insn_info->insn, 4, (void *) ctx->regs.pc);
-#elif __TARGET_ARCH_x86
-  retval = bpf_probe_read_user(insn_info->insn, 15, (void *) ctx->regs.ip);
-#endif
+  retval = fetch_insn(insn_info->insn, ip);
   if(retval < 0) {
     bpf_ringbuf_discard(insn_info, BPF_RB_NO_WAKEUP);
+    count_stat(stats_ptr, fetch_failed);
     return 1;
   }
-  bpf_get_current_comm(insn_info->name, sizeof(insn_info->name));
   
   /* Place insn_info in the ringbuf */
-  bpf_ringbuf_submit(insn_info, BPF_RB_NO_WAKEUP);
+  bpf_ringbuf_submit(insn_info, wakeup_flags(ringbuf));
   
   return 0;
 }
 
+/**
+  emit_exit: Sends a RECORD_EXIT for the process (or thread) that userspace
+  knows as `key`, if it knows about it at all. `key` isn't always the
+  current task's, so it's sent as both the PID and the TID. The key is
+  only forgotten once userspace has been told; if there's no room, the
+  next fork that reuses it tries again.
+**/
+static __always_inline void emit_exit(void *ctx, u32 key) {
+  struct comm_info *comm_info;
+  struct insn_stats *stats_ptr;
+  struct seen_comm *comm;
+  void *ringbuf;
+  u32 cpu;
+  
+  if(!key) {
+    return;
+  }
+  comm = bpf_map_lookup_elem(&seen, &key);
+  if(!comm) {
+    return;
+  }
+  
+  ringbuf = &rb;
+  if(sharded) {
+    cpu = bpf_get_smp_processor_id();
+    ringbuf = bpf_map_lookup_elem(&rb_shards, &cpu);
+    if(!ringbuf) {
+      stats_ptr = get_stats();
+      count_stat(stats_ptr, lost_exits);
+      return;
+    }
+  }
+  
+  comm_info = bpf_ringbuf_reserve(ringbuf, sizeof(struct comm_info), 0);
+  if(!comm_info) {
+    stats_ptr = get_stats();
+    count_stat(stats_ptr, lost_exits);
+    return;
+  }
+  
+  comm_info->pid = key;
+  comm_info->tid = key;
+  comm_info->type = RECORD_EXIT;
+  __builtin_memcpy(comm_info->name, comm->name, TASK_COMM_LEN);
+  __builtin_memcpy(comm_info->thread_name, comm->thread_name, TASK_COMM_LEN);
+  comm_info->cgroup_id = comm->cgroup_id;
+  comm_info->gen = comm->gen;
+  bpf_ringbuf_submit(comm_info, wakeup_flags(ringbuf));
+  
+  bpf_map_delete_elem(&seen, &key);
+}
+
 #endif
 
+SEC("tp/sched/sched_process_exec")
+int handle_exec(struct trace_event_raw_sched_process_exec *ctx) {
+  /* The old image is gone, even if the name is the same. By now, the
+     thread that exec'd has taken over the leader's PID. */
+  emit_exit(ctx, lifecycle_key(false));
+  return 0;
+}
+
+SEC("tp/sched/sched_process_exit")
+int handle_exit(struct trace_event_raw_sched_process_template *ctx) {
+  emit_exit(ctx, lifecycle_key(true));
+  return 0;
+}
+
+/**
+  SELF TIME: in debug mode, counts how long our own threads ran on each
+  CPU, so that userspace can tell how much it perturbs the CPUs that it
+  samples. Every context switch ends the previous task's slice, so each
+  CPU only needs to remember when it last switched.
+**/
+
+struct {
+  __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+  __uint(max_entries, 1);
+  __type(key, __u32);
+  __type(value, __u64);
+} last_switch SEC(".maps");
+
+SEC("tp/sched/sched_switch")
+int handle_switch(struct trace_event_raw_sched_switch *ctx) {
+  struct insn_stats *stats_ptr;
+  u64 now, *last;
+  u32 zero = 0;
+  
+  last = bpf_map_lookup_elem(&last_switch, &zero);
+  if(!last) {
+    return 0;
+  }
+  
+  /* The outgoing task is still current */
+  now = bpf_ktime_get_ns();
+  if(*last && self_tgid && ((bpf_get_current_pid_tgid() >> 32) == self_tgid)) {
+    stats_ptr = get_stats();
+    if(stats_ptr) {
+      stats_ptr->self_ns += now - *last;
+    }
+  }
+  *last = now;
+  
+  return 0;
+}
+
+SEC("tp/sched/sched_process_fork")
+int handle_fork(struct trace_event_raw_sched_process_fork *ctx) {
+  u32 child = ctx->child_pid;
+  
+  /* If we couldn't send the exit of the PID's last user, send it now.
+     The child hasn't run yet, so it can't have been sampled. */
+  emit_exit(ctx, child);
+  return 0;
+}
+
 char LICENSE[] SEC("license") = "GPL";
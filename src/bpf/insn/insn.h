@@ -5,12 +5,107 @@
 #define INSN_H
 
 #define TASK_COMM_LEN 16
+/* The ringbuffer's size in the BPF object. Userspace resizes it before
+   loading, based on the number of CPUs and the sampling rate. */
 #define MAX_ENTRIES 512*1024*1024
 
+/* Number of unique (process, instruction) pairs that the
+   aggregation map can hold in a single interval */
+#define AGG_MAX_ENTRIES 16384
+
+/* In aggregation mode, the ringbuffer only carries process names */
+#define COMM_ONLY_ENTRIES 256*1024
+
+/* Number of processes whose names the BPF program remembers */
+#define SEEN_MAX_ENTRIES 65536
+
+/* Number of PIDs that -p can be given */
+#define MAX_FILTER_PIDS 1024
+
+/* Number of process name prefixes that --comm can be given */
+#define MAX_COMM_PREFIXES 8
+
+/* The types of records that the BPF program emits. Every
+   record starts with the PID and the type. */
+#define RECORD_SAMPLE 0
+#define RECORD_COMM   1
+#define RECORD_EXIT   2
+
+/* The TID fits in what would otherwise be padding in the ringbuffer */
 struct insn_info {
+  __u32 pid;
+  __u8  type;
+  unsigned char insn[15];
+  __u32 tid;
+};
+
+/**
+  comm_info
+  **
+  Sent the first time that a process is sampled, and whenever its
+  name or cgroup changes, instead of sending them with every sample.
+  `name` is the thread group leader's, so that named threads don't
+  split a process. The cgroup is only filled in if userspace asks for
+  it, and the thread's own name only if it wants per-thread rows, in
+  which case there's one of these per thread.
+  **
+  RECORD_EXIT records have the same layout, and carry the names that
+  userspace was last sent, so that it can tell which process is gone
+  even if the PID has already been reused.
+  **
+  The two can arrive in either order, since they can go through different
+  shards, so each RECORD_COMM is stamped with the time that it was sent,
+  and each RECORD_EXIT with the stamp of the RECORD_COMM that it ends.
+  Userspace ignores an exit that's older than the name that it has.
+**/
+struct comm_info {
+  __u32 pid;
+  __u8  type;
+  char  name[TASK_COMM_LEN];
+  __u64 cgroup_id;
+  __u32 tid;
+  char  thread_name[TASK_COMM_LEN];
+  __u64 gen;
+};
+
+/**
+  insn_stats
+  **
+  Per-CPU counts of what happened to each sample, so that userspace
+  can tell how much of the profile is missing, and from which CPUs.
+**/
+struct insn_stats {
+  __u64 samples;       /* Every time the BPF program ran */
+  __u64 lost;          /* No room in the ringbuffer or aggregation map */
+  __u64 fetch_failed;  /* Couldn't read the instruction's bytes */
+  __u64 kernel;        /* The instruction was in the kernel */
+  __u64 self_ns;       /* How long our own threads ran, in debug mode */
+  __u64 lost_exits;    /* Exit records that had no room in the ringbuffer */
+};
+
+/**
+  comm_prefix
+  **
+  A process name prefix to sample. A name matches if its bytes, masked
+  with `mask`, equal `prefix`, so that the BPF program can compare
+  whole words instead of looping over characters.
+**/
+struct comm_prefix {
+  __u64 prefix[TASK_COMM_LEN / 8];
+  __u64 mask[TASK_COMM_LEN / 8];
+};
+
+/**
+  insn_agg_key
+  **
+  The key of the per-CPU aggregation map. The padding is explicit
+  so that the BPF program can zero it: hash map keys are compared
+  byte-for-byte. When counting per thread, `pid` is the TID.
+**/
+struct insn_agg_key {
   __u32 pid;
   unsigned char insn[15];
-  char name[TASK_COMM_LEN];
+  unsigned char pad;
 };
 
 #endif
@@ -0,0 +1,172 @@
+/* Copyright (C) 2022 Intel Corporation */
+/* SPDX-License-Identifier: GPL-2.0-only */
+
+#pragma once
+
+#include <time.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
+#include <linux/perf_event.h>
+
+/**
+  DUTY CYCLE
+  **
+  With --duty-cycle <secs>, the perf events are only enabled for <secs>
+  seconds of each interval, so the average overhead falls by about the
+  same fraction. The window opens at the start of each interval, or with
+  --duty-random, at a random offset into it, so that periodic behavior in
+  the workload isn't always caught at the same phase.
+  Percentages are unaffected, since every process is sampled during the
+  same window. Sample counts are scaled up by how much of the interval
+  the events were disabled for, which each interval records.
+**/
+
+static int duty_fd = -1;
+static struct timespec duty_interval_start, duty_enabled_since;
+static uint64_t duty_enabled_ns;
+
+static int duty_cycle_enabled() {
+  return pw_opts.duty_on_ms > 0;
+}
+
+static uint64_t duty_ns_since(struct timespec *start) {
+  struct timespec now;
+  
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000000000ULL + now.tv_nsec - start->tv_nsec;
+}
+
+/**
+  set_events_enabled: Enables or disables the perf event on every CPU,
+  and keeps track of how long they've been enabled for.
+**/
+static void set_events_enabled(int enabled) {
+  unsigned long request;
+  size_t i;
+  
+  if(enabled == !bpf_info->events_disabled) {
+    return;
+  }
+  
+  request = enabled ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE;
+  for(i = 0; i < bpf_info->num_links; i++) {
+    if(bpf_info->perf_fds[i] < 0) continue;
+    if(ioctl(bpf_info->perf_fds[i], request, 0) != 0) {
+      fprintf(stderr, "Failed to %s the perf event on CPU %zu: %s\n",
+              enabled ? "enable" : "disable", i, strerror(errno));
+    }
+  }
+  
+  if(enabled) {
+    clock_gettime(CLOCK_MONOTONIC, &duty_enabled_since);
+  } else {
+    duty_enabled_ns += duty_ns_since(&duty_enabled_since);
+  }
+  bpf_info->events_disabled = !enabled;
+}
+
+static void arm_duty_timer(uint64_t ms) {
+  struct itimerspec its = {0};
+  
+  /* A zero timer would disarm it */
+  if(ms == 0) {
+    ms = 1;
+  }
+  its.it_value.tv_sec = ms / 1000;
+  its.it_value.tv_nsec = (ms % 1000) * 1000000;
+  if(timerfd_settime(duty_fd, 0, &its, NULL) != 0) {
+    fprintf(stderr, "Error setting the duty cycle timer: %s\n", strerror(errno));
+  }
+}
+
+/**
+  schedule_duty_window: Called at the start of each interval. Opens the
+  window now, or arms the timer to open it later on.
+**/
+static void schedule_duty_window() {
+  uint64_t offset_ms, slack_ms;
+  
+  clock_gettime(CLOCK_MONOTONIC, &duty_interval_start);
+  duty_enabled_ns = 0;
+  
+  offset_ms = 0;
+  if(pw_opts.duty_random) {
+    slack_ms = pw_opts.interval_time * 1000ULL - pw_opts.duty_on_ms;
+    offset_ms = rand() % (slack_ms + 1);
+  }
+  
+  if(offset_ms == 0) {
+    set_events_enabled(1);
+    arm_duty_timer(pw_opts.duty_on_ms);
+  } else {
+    arm_duty_timer(offset_ms);
+  }
+}
+
+/**
+  handle_duty_timer: The timer either opens the window, and is armed
+  again to close it, or closes it until the next interval.
+**/
+static void handle_duty_timer() {
+  uint64_t expirations;
+  
+  if(read(duty_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+    return;
+  }
+  
+  if(bpf_info->events_disabled) {
+    set_events_enabled(1);
+    arm_duty_timer(pw_opts.duty_on_ms);
+  } else {
+    set_events_enabled(0);
+  }
+}
+
+/**
+  end_duty_window: Called at the end of each interval, before the next
+  window is scheduled. Closes the window if it's still open, and returns
+  how much the interval's sample counts should be scaled up by.
+**/
+static double end_duty_window() {
+  uint64_t interval_ns;
+  
+  if(!duty_cycle_enabled()) {
+    return 1.0;
+  }
+  
+  set_events_enabled(0);
+  interval_ns = duty_ns_since(&duty_interval_start);
+  if(duty_enabled_ns == 0) {
+    return 1.0;
+  }
+  return ((double) interval_ns) / duty_enabled_ns;
+}
+
+/**
+  init_duty_cycle: Disables the events until the first window opens.
+  Returns the timer's fd, for the main loop to wait on, or -1. It's
+  nonblocking, since rescheduling at the end of an interval can reset
+  it after epoll said that it was readable.
+**/
+static int init_duty_cycle() {
+  duty_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  if(duty_fd < 0) {
+    fprintf(stderr, "Error creating the duty cycle timer: %s\n", strerror(errno));
+    return -1;
+  }
+  srand(time(NULL) ^ getpid());
+  
+  /* The events start out enabled */
+  clock_gettime(CLOCK_MONOTONIC, &duty_enabled_since);
+  set_events_enabled(0);
+  schedule_duty_window();
+  
+  return duty_fd;
+}
+
+static void deinit_duty_cycle() {
+  if(duty_fd >= 0) {
+    close(duty_fd);
+  }
+}
@@ -0,0 +1,123 @@
+/* Copyright (C) 2022 Intel Corporation */
+/* SPDX-License-Identifier: GPL-2.0-only */
+
+#pragma once
+
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+
+/**
+  SAMPLE PERIOD GOVERNOR
+  **
+  With --overhead-budget or --sample-rate, the sampling period of every
+  perf event is retuned at the end of each interval. It's scaled by how far
+  we were from the target: our own CPU usage, or samples per second.
+  If the ringbuffers were filling up, or samples were lost, it backs
+  off regardless.
+  Each interval records the period that was in effect during it.
+**/
+
+#define GOVERNOR_MIN_PERIOD 1000
+#define GOVERNOR_MAX_PERIOD 1000000000ULL
+
+/* The most that the period can change in one interval, and the
+   smallest change that's worth making */
+#define GOVERNOR_MAX_STEP 4.0
+#define GOVERNOR_DEADBAND 0.1
+
+/* Back off if a ringbuffer was more than this full, or if
+   more than this fraction of samples were lost */
+#define GOVERNOR_HIGH_FILL 0.5
+#define GOVERNOR_HIGH_LOSS 0.01
+
+static struct timespec governor_wall, governor_cpu;
+
+static int governor_enabled() {
+  return (pw_opts.overhead_budget > 0) || (pw_opts.sample_rate > 0);
+}
+
+static double timespec_secs(struct timespec *start, struct timespec *end) {
+  return (end->tv_sec - start->tv_sec) + ((end->tv_nsec - start->tv_nsec) / 1e9);
+}
+
+static void init_governor() {
+  bpf_info->sample_period = pw_opts.sample_period;
+  clock_gettime(CLOCK_MONOTONIC, &governor_wall);
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &governor_cpu);
+}
+
+/**
+  set_sample_period: Changes the period of every perf event.
+**/
+static int set_sample_period(uint64_t period) {
+  size_t i;
+  
+  for(i = 0; i < bpf_info->num_links; i++) {
+    if(bpf_info->perf_fds[i] < 0) continue;
+    if(ioctl(bpf_info->perf_fds[i], PERF_EVENT_IOC_PERIOD, &period) != 0) {
+      fprintf(stderr, "Failed to change the sampling period: %s\n", strerror(errno));
+      return -1;
+    }
+  }
+  bpf_info->sample_period = period;
+  
+  return 0;
+}
+
+/**
+  update_governor: Called at the end of each interval with its number
+  of samples, how many the BPF program lost, and how full the fullest
+  ringbuffer was. The targets apply while the events are enabled, so
+  with a duty cycle, `duty_scale` scales the rate and usage up to match.
+**/
+static void update_governor(uint64_t num_samples, uint64_t lost, double ringbuf_used,
+                            double duty_scale) {
+  struct timespec wall, cpu;
+  double wall_secs, cpu_percent, rate, factor;
+  uint64_t period;
+  
+  clock_gettime(CLOCK_MONOTONIC, &wall);
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+  wall_secs = timespec_secs(&governor_wall, &wall);
+  cpu_percent = timespec_secs(&governor_cpu, &cpu) / wall_secs * 100 * duty_scale;
+  governor_wall = wall;
+  governor_cpu = cpu;
+  if(wall_secs <= 0) {
+    return;
+  }
+  
+  /* A factor over 1 means that we're sampling too often */
+  if(pw_opts.overhead_budget > 0) {
+    factor = cpu_percent / pw_opts.overhead_budget;
+  } else {
+    rate = num_samples / wall_secs * duty_scale;
+    factor = rate / pw_opts.sample_rate;
+  }
+  if(((ringbuf_used > GOVERNOR_HIGH_FILL) ||
+      (lost > (num_samples + lost) * GOVERNOR_HIGH_LOSS)) &&
+     (factor < 2)) {
+    factor = 2;
+  }
+  
+  if(factor > GOVERNOR_MAX_STEP) {
+    factor = GOVERNOR_MAX_STEP;
+  } else if(factor < 1 / GOVERNOR_MAX_STEP) {
+    factor = 1 / GOVERNOR_MAX_STEP;
+  }
+  if((factor > 1 - GOVERNOR_DEADBAND) && (factor < 1 + GOVERNOR_DEADBAND)) {
+    return;
+  }
+  
+  period = bpf_info->sample_period * factor;
+  if(period < GOVERNOR_MIN_PERIOD) {
+    period = GOVERNOR_MIN_PERIOD;
+  } else if(period > GOVERNOR_MAX_PERIOD) {
+    period = GOVERNOR_MAX_PERIOD;
+  }
+  if(period == bpf_info->sample_period) {
+    return;
+  }
+  
+  set_sample_period(period);
+}
@@ -0,0 +1,93 @@
+/* Copyright (C) 2022 Intel Corporation */
+/* SPDX-License-Identifier: GPL-2.0-only */
+
+#pragma once
+
+#include <sched.h>
+#include <sys/resource.h>
+
+/**
+  HOUSEKEEPING
+  **
+  Keeps our own threads off of the CPUs that we're profiling. With
+  --housekeeping-cpus, every thread is pinned to the given CPUs, and
+  --sched-batch and --nice lower their priority. These are per-thread,
+  so they're applied to the main thread before any others are started,
+  and the consumer, decode and output threads inherit them.
+**/
+
+static int pin_to_housekeeping_cpus() {
+  cpu_set_t *set;
+  size_t set_size;
+  char *mask;
+  int nr_cpus, cpu, err;
+  
+  nr_cpus = libbpf_num_possible_cpus();
+  if(nr_cpus <= 0) {
+    fprintf(stderr, "Failed to get the number of CPUs.\n");
+    return -1;
+  }
+  
+  mask = malloc(nr_cpus);
+  set = CPU_ALLOC(nr_cpus);
+  if(!mask || !set) {
+    fprintf(stderr, "Failed to allocate memory! Aborting.\n");
+    exit(1);
+  }
+  set_size = CPU_ALLOC_SIZE(nr_cpus);
+  
+  err = 0;
+  if(parse_cpulist(pw_opts.housekeeping_cpus, mask, nr_cpus) != 0) {
+    fprintf(stderr, "Invalid housekeeping CPU list '%s'. This system has CPUs 0-%d.\n",
+            pw_opts.housekeeping_cpus, nr_cpus - 1);
+    err = -1;
+    goto cleanup;
+  }
+  
+  CPU_ZERO_S(set_size, set);
+  for(cpu = 0; cpu < nr_cpus; cpu++) {
+    if(mask[cpu]) {
+      CPU_SET_S(cpu, set_size, set);
+    }
+  }
+  if(sched_setaffinity(0, set_size, set) != 0) {
+    fprintf(stderr, "Failed to pin to the housekeeping CPUs: %s\n", strerror(errno));
+    err = -1;
+  }
+  
+cleanup:
+  CPU_FREE(set);
+  free(mask);
+  return err;
+}
+
+/**
+  apply_housekeeping: Called from the main thread before any other
+  threads exist. Returns -1 if any of the settings couldn't be applied.
+**/
+static int apply_housekeeping() {
+  struct sched_param param = {0};
+  
+  if(pw_opts.housekeeping_cpus) {
+    if(pin_to_housekeeping_cpus() != 0) {
+      return -1;
+    }
+  }
+  
+  if(pw_opts.sched_batch) {
+    if(sched_setscheduler(0, SCHED_BATCH, &param) != 0) {
+      fprintf(stderr, "Failed to switch to SCHED_BATCH: %s\n", strerror(errno));
+      return -1;
+    }
+  }
+  
+  /* On Linux, this only changes the calling thread */
+  if(pw_opts.nice) {
+    if(setpriority(PRIO_PROCESS, 0, pw_opts.nice) != 0) {
+      fprintf(stderr, "Failed to set the nice value: %s\n", strerror(errno));
+      return -1;
+    }
+  }
+  
+  return 0;
+}
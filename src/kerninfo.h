@@ -155,4 +155,64 @@ char supports_amx_tile() {
   return 0;
 }
 
+/**
+  parse_cpulist: Parses a list of CPUs in the kernel's format, e.g.
+  "0-3,8,10-11", into `mask`, which has a byte per CPU. Returns -1 if
+  it's malformed or names a CPU past `nr_cpus`.
+**/
+static int parse_cpulist(const char *str, char *mask, int nr_cpus) {
+  char *end;
+  long first, last, cpu;
+  
+  memset(mask, 0, nr_cpus);
+  while(*str && (*str != '\n')) {
+    first = strtol(str, &end, 10);
+    if((end == str) || (first < 0)) {
+      return -1;
+    }
+    last = first;
+    str = end;
+    if(*str == '-') {
+      str++;
+      last = strtol(str, &end, 10);
+      if((end == str) || (last < first)) {
+        return -1;
+      }
+      str = end;
+    }
+    if(last >= nr_cpus) {
+      return -1;
+    }
+    for(cpu = first; cpu <= last; cpu++) {
+      mask[cpu] = 1;
+    }
+    if(*str == ',') {
+      str++;
+    } else if(*str && (*str != '\n')) {
+      return -1;
+    }
+  }
+  
+  return 0;
+}
+
+/**
+  read_online_cpus: Reads which CPUs are online into `mask`.
+**/
+static int read_online_cpus(char *mask, int nr_cpus) {
+  char buf[4096];
+  FILE *f;
+  size_t len;
+  
+  f = fopen("/sys/devices/system/cpu/online", "r");
+  if(!f) {
+    return -1;
+  }
+  len = fread(buf, sizeof(char), sizeof(buf) - 1, f);
+  fclose(f);
+  buf[len] = '\0';
+  
+  return parse_cpulist(buf, mask, nr_cpus);
+}
+
 #endif
@@ -4,6 +4,8 @@
 #pragma once
 
 #include <assert.h>
+#include <fcntl.h>
+#include <limits.h>
 
 #define resize_array(ptr, old_size, new_size, datatype, new_value, iterator) \
   ptr = realloc(ptr, new_size * sizeof(datatype)); \
@@ -16,55 +18,150 @@
   } \
 
 /**
-  grow_interval_proc_arrs: This grows the per-process arrays in
-  the `interval_results_t` struct. It ensures that the per-process
-  array can store up to `pid_ctr + 1` values.
+  alloc_proc_counts: Allocates an empty, cache-line-aligned
+  counter block for one process.
 **/
-#define INITIAL_SIZE 64
-static void grow_interval_proc_arrs() {
-  int old_size, new_size, i, n;
+static proc_counts_t *alloc_proc_counts() {
+  proc_counts_t *proc;
   
-  /* We don't need to allocate anything */
-  if((results->interval->pid_ctr <= results->interval->proc_arr_size - 1) &&
-     (results->interval->proc_arr_size != 0)) {
-    return;
+  proc = aligned_alloc(64, sizeof(proc_counts_t));
+  if(!proc) {
+    fprintf(stderr, "Failed to allocate memory! Aborting.\n");
+    exit(1);
   }
+  memset(proc, 0, sizeof(proc_counts_t));
   
-  /* Figure out the old size and new size */
-  old_size = results->interval->proc_arr_size;
-  if(old_size == 0) {
-    new_size = INITIAL_SIZE;
-  } else {
-    new_size = (results->interval->proc_arr_size * 2);
+  return proc;
+}
+
+static void free_proc_counts(proc_counts_t *proc) {
+  if(!proc) return;
+  free(proc->insn_count);
+  free(proc);
+}
+
+/**
+  clear_proc_counts: Zeroes a counter block, keeping its mnemonic
+  table allocated for the next process that uses it.
+**/
+static void clear_proc_counts(proc_counts_t *proc) {
+  insn_count_entry_t *insn_count;
+  uint32_t insn_count_size;
+  
+  insn_count = proc->insn_count;
+  insn_count_size = proc->insn_count_size;
+  if(proc->insn_count_used) {
+    memset(insn_count, 0, insn_count_size * sizeof(insn_count_entry_t));
   }
   
-  /* Per-process totals */
-  resize_array(results->interval->proc_percent, old_size, new_size, double, 0, n);
-  resize_array(results->interval->proc_failed_percent, old_size, new_size, double, 0, n);
-  resize_array(results->interval->proc_num_samples, old_size, new_size, uint64_t, 0, n);
-  resize_array(results->interval->proc_num_failed, old_size, new_size, uint64_t, 0, n);
-  resize_array(results->interval->pids, old_size, new_size, uint32_t, 0, n);
+  memset(proc, 0, sizeof(proc_counts_t));
+  proc->insn_count = insn_count;
+  proc->insn_count_size = insn_count_size;
+}
+
+static insn_count_entry_t *find_insn_count(insn_count_entry_t *table, uint32_t size,
+                                           uint32_t mnemonic) {
+  uint32_t i;
   
-  /* CATEGORIES */
-  for(i = 0; i <= CATEGORY_MAX_VALUE; i++) {
-    resize_array(results->interval->proc_cat_count[i], old_size, new_size, uint64_t, 0, n);
-    resize_array(results->interval->proc_cat_percent[i], old_size, new_size, double, 0, n);
+  i = (mnemonic * 2654435769U) & (size - 1);
+  while(table[i].count && (table[i].mnemonic != mnemonic)) {
+    i = (i + 1) & (size - 1);
   }
   
-  /* MNEMONICS */
-  for(i = 0; i <= MNEMONIC_MAX_VALUE; i++) {
-    resize_array(results->interval->proc_insn_count[i], old_size, new_size, uint64_t, 0, n);
-    resize_array(results->interval->proc_insn_percent[i], old_size, new_size, double, 0, n);
+  return &(table[i]);
+}
+
+/**
+  add_proc_insn_count: Adds `count` to a process's count for `mnemonic`.
+**/
+#define INSN_COUNT_INITIAL_SIZE 16
+static void add_proc_insn_count(proc_counts_t *proc, uint32_t mnemonic, uint64_t count) {
+  insn_count_entry_t *old, *entry;
+  uint32_t old_size, i;
+  
+  /* Keep the table at most half full */
+  if(proc->insn_count_used * 2 >= proc->insn_count_size) {
+    old = proc->insn_count;
+    old_size = proc->insn_count_size;
+    proc->insn_count_size = old_size ? old_size * 2 : INSN_COUNT_INITIAL_SIZE;
+    proc->insn_count = calloc(proc->insn_count_size, sizeof(insn_count_entry_t));
+    if(!proc->insn_count) {
+      fprintf(stderr, "Failed to allocate memory! Aborting.\n");
+      exit(1);
+    }
+    for(i = 0; i < old_size; i++) {
+      if(!old[i].count) continue;
+      *find_insn_count(proc->insn_count, proc->insn_count_size, old[i].mnemonic) = old[i];
+    }
+    free(old);
+  }
+  
+  entry = find_insn_count(proc->insn_count, proc->insn_count_size, mnemonic);
+  if(!entry->count) {
+    entry->mnemonic = mnemonic;
+    proc->insn_count_used++;
   }
+  entry->count += count;
+}
+
+static uint64_t get_proc_insn_count(proc_counts_t *proc, uint32_t mnemonic) {
+  if(!proc->insn_count_used) {
+    return 0;
+  }
+  return find_insn_count(proc->insn_count, proc->insn_count_size, mnemonic)->count;
+}
+
+/**
+  merge_proc_counts: Adds the counts in `src` to `dst`.
+**/
+static void merge_proc_counts(proc_counts_t *dst, proc_counts_t *src) {
+  uint32_t n;
   
+  dst->num_samples += src->num_samples;
+  dst->num_failed += src->num_failed;
+  for(n = 0; n <= CATEGORY_MAX_VALUE; n++) {
+    dst->cat_count[n] += src->cat_count[n];
+  }
 #ifdef __x86_64__
-  for(i = 0; i <= EXTENSION_MAX_VALUE; i++) {
-    resize_array(results->interval->proc_ext_count[i], old_size, new_size, uint64_t, 0, n);
-    resize_array(results->interval->proc_ext_percent[i], old_size, new_size, double, 0, n);
+  for(n = 0; n <= EXTENSION_MAX_VALUE; n++) {
+    dst->ext_count[n] += src->ext_count[n];
   }
 #endif
+  for(n = 0; n < src->insn_count_size; n++) {
+    if(!src->insn_count[n].count) continue;
+    add_proc_insn_count(dst, src->insn_count[n].mnemonic,
+                        src->insn_count[n].count);
+  }
+}
+
+/**
+  grow_interval_proc_arrs: This grows the per-process arrays in
+  an `interval_results_t` struct. It ensures that they can store
+  up to `pid_ctr + 1` processes.
+**/
+#define INITIAL_SIZE 64
+static void grow_interval_proc_arrs(interval_results_t *interval) {
+  int old_size, new_size, n;
   
-  results->interval->proc_arr_size = new_size;
+  /* We don't need to allocate anything */
+  if((interval->pid_ctr <= interval->proc_arr_size - 1) &&
+     (interval->proc_arr_size != 0)) {
+    return;
+  }
+  
+  /* Figure out the old size and new size */
+  old_size = interval->proc_arr_size;
+  if(old_size == 0) {
+    new_size = INITIAL_SIZE;
+  } else {
+    new_size = (interval->proc_arr_size * 2);
+  }
+  
+  /* Counter blocks are allocated when a slot is first used */
+  resize_array(interval->procs, old_size, new_size, proc_counts_t *, NULL, n);
+  resize_array(interval->pids, old_size, new_size, uint32_t, 0, n);
+  
+  interval->proc_arr_size = new_size;
   
   return;
 }
@@ -81,28 +178,246 @@ static uint32_t djb2(char *name) {
 }
 
 /**
-  get_num_process_info
+  arena_alloc
   **
-  Get the number of processes that have been associated with this PID thus far.
+  Bump-allocates `size` bytes from the process table's arena.
 **/
-static int get_num_process_info(uint32_t pid) {
-  int num_procs;
-  process_t **ptr;
-  process_t **proc_arr;
+static void *arena_alloc(size_t size) {
+  arena_chunk_t *chunk;
+  size_t chunk_size;
+  void *ptr;
   
-  proc_arr = results->process_info.arr[pid];
-  if(!proc_arr) {
-    return 0;
+  /* Keep everything pointer-aligned */
+  size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+  
+  chunk = results->process_info.arena;
+  if(!chunk || (chunk->size - chunk->used < size)) {
+    chunk_size = ARENA_CHUNK_SIZE;
+    if(size > chunk_size) {
+      chunk_size = size;
+    }
+    chunk = malloc(sizeof(arena_chunk_t) + chunk_size);
+    if(!chunk) {
+      fprintf(stderr, "Failed to allocate memory! Aborting.\n");
+      exit(1);
+    }
+    chunk->used = 0;
+    chunk->size = chunk_size;
+    chunk->next = results->process_info.arena;
+    results->process_info.arena = chunk;
   }
   
-  num_procs = 0;
-  ptr = &(proc_arr[0]);
-  while(*ptr) {
-    num_procs++;
-    ptr++;
+  ptr = chunk->data + chunk->used;
+  chunk->used += size;
+  return ptr;
+}
+
+/**
+  alloc_interned_str
+  **
+  Allocates an interned_str_t holding a copy of `str`, and returns the copy.
+**/
+static char *alloc_interned_str(char *str, uint32_t hash) {
+  interned_str_t *interned;
+  size_t len;
+  
+  len = strlen(str) + 1;
+  interned = malloc(sizeof(interned_str_t) + len);
+  if(!interned) {
+    fprintf(stderr, "Failed to allocate memory! Aborting.\n");
+    exit(1);
   }
+  interned->next_dead = NULL;
+  interned->dead_interval = 0;
+  interned->refs = 1;
+  interned->hash = hash;
+  memcpy(interned->str, str, len);
   
-  return num_procs;
+  return interned->str;
+}
+
+/**
+  bury_interned_str
+  **
+  Puts a string that nothing refers to anymore on the graveyard. The
+  snapshot of `interval_num` may still point to it.
+**/
+static void bury_interned_str(char *str, uint64_t interval_num) {
+  interned_str_t *interned;
+  
+  interned = INTERNED_STR(str);
+  interned->dead_interval = interval_num;
+  interned->next_dead = results->process_info.graveyard;
+  results->process_info.graveyard = interned;
+}
+
+/**
+  free_dead_strs
+  **
+  Frees the strings on the graveyard that only snapshots from before
+  `oldest_in_use` could have pointed to.
+**/
+static void free_dead_strs(uint64_t oldest_in_use) {
+  interned_str_t **link, *interned;
+  
+  link = &(results->process_info.graveyard);
+  while(*link) {
+    interned = *link;
+    if(interned->dead_interval >= oldest_in_use) {
+      link = &(interned->next_dead);
+      continue;
+    }
+    *link = interned->next_dead;
+    free(interned);
+  }
+}
+
+/**
+  intern_name
+  **
+  Returns the single stored copy of `name`, adding it to the table
+  if it isn't there. Each call takes a reference, which release_name drops.
+**/
+#define NAMES_INITIAL_SIZE 256
+static char *intern_name(char *name, uint32_t hash) {
+  process_arr_t *info;
+  char **old_names;
+  uint32_t old_size, i, n;
+  
+  info = &(results->process_info);
+  
+  /* Keep the table at most half full */
+  if(info->names_count * 2 >= info->names_size) {
+    old_names = info->names;
+    old_size = info->names_size;
+    info->names_size = old_size ? old_size * 2 : NAMES_INITIAL_SIZE;
+    info->names = calloc(info->names_size, sizeof(char *));
+    if(!info->names) {
+      fprintf(stderr, "Failed to allocate memory! Aborting.\n");
+      exit(1);
+    }
+    for(n = 0; n < old_size; n++) {
+      if(!old_names[n]) continue;
+      i = INTERNED_STR(old_names[n])->hash & (info->names_size - 1);
+      while(info->names[i]) {
+        i = (i + 1) & (info->names_size - 1);
+      }
+      info->names[i] = old_names[n];
+    }
+    free(old_names);
+  }
+  
+  i = hash & (info->names_size - 1);
+  while(info->names[i]) {
+    if(strcmp(info->names[i], name) == 0) {
+      INTERNED_STR(info->names[i])->refs++;
+      return info->names[i];
+    }
+    i = (i + 1) & (info->names_size - 1);
+  }
+  
+  info->names[i] = alloc_interned_str(name, hash);
+  info->names_count++;
+  
+  return info->names[i];
+}
+
+/**
+  release_name
+  **
+  Drops a reference to an interned name. The last one takes it out of
+  the table, shifting later entries in its probe sequence back, and
+  buries it.
+**/
+static void release_name(char *name, uint64_t interval_num) {
+  process_arr_t *info;
+  uint32_t i, j, home, mask;
+  
+  if(--(INTERNED_STR(name)->refs) > 0) {
+    return;
+  }
+  
+  info = &(results->process_info);
+  mask = info->names_size - 1;
+  i = INTERNED_STR(name)->hash & mask;
+  while(info->names[i] != name) {
+    i = (i + 1) & mask;
+  }
+  
+  j = i;
+  while(1) {
+    j = (j + 1) & mask;
+    if(!info->names[j]) {
+      break;
+    }
+    home = INTERNED_STR(info->names[j])->hash & mask;
+    if((i <= j) ? ((home <= i) || (home > j)) : ((home <= i) && (home > j))) {
+      info->names[i] = info->names[j];
+      i = j;
+    }
+  }
+  info->names[i] = NULL;
+  info->names_count--;
+  
+  bury_interned_str(name, interval_num);
+}
+
+static uint32_t hash_process_slot(uint32_t pid, uint32_t size) {
+  return (pid * 2654435769U) & (size - 1);
+}
+
+/**
+  get_process_slot
+  **
+  Returns the hash table entry for this PID. If the PID isn't in the
+  table, this is the empty entry where it would go.
+**/
+static process_slot_t *get_process_slot(uint32_t pid) {
+  process_arr_t *info;
+  uint32_t i;
+  
+  info = &(results->process_info);
+  i = hash_process_slot(pid, info->size);
+  while(info->slots[i].latest) {
+    if(info->slots[i].pid == pid) {
+      break;
+    }
+    i = (i + 1) & (info->size - 1);
+  }
+  
+  return &(info->slots[i]);
+}
+
+/**
+  grow_process_info
+  **
+  Keeps the PID table at most half full.
+**/
+#define PROCESS_SLOTS_INITIAL_SIZE 1024
+static void grow_process_info() {
+  process_arr_t *info;
+  process_slot_t *old_slots;
+  uint32_t old_size, n;
+  
+  info = &(results->process_info);
+  if(info->size && (info->count * 2 < info->size)) {
+    return;
+  }
+  
+  old_slots = info->slots;
+  old_size = info->size;
+  info->size = old_size ? old_size * 2 : PROCESS_SLOTS_INITIAL_SIZE;
+  info->slots = calloc(info->size, sizeof(process_slot_t));
+  if(!info->slots) {
+    fprintf(stderr, "Failed to allocate memory! Aborting.\n");
+    exit(1);
+  }
+  
+  for(n = 0; n < old_size; n++) {
+    if(!old_slots[n].latest) continue;
+    *get_process_slot(old_slots[n].pid) = old_slots[n];
+  }
+  free(old_slots);
 }
 
 /**
@@ -111,128 +426,527 @@ static int get_num_process_info(uint32_t pid) {
   Gets the process_t pointer for the latest process that's using this PID.
 **/
 static process_t *get_interval_process_info(uint32_t pid) {
-  int num_procs;
-  
-  num_procs = get_num_process_info(pid);
-  if(!num_procs) return NULL;
-  return results->process_info.arr[pid][num_procs - 1];
+  return get_process_slot(pid)->latest;
 }
 
 /**
   get_process_info
   **
-  Returns a process_t to the process with the given PID, hash of the name.
-  If not found, returns NULL.
+  Returns a process_t to the live process with the given PID and name,
+  whose hash is `hash`. If not found, returns NULL.
 **/
-static process_t *get_process_info(uint32_t pid, uint32_t hash) {
+static process_t *get_process_info(uint32_t pid, char *name, uint32_t hash) {
   process_t *process;
-  process_t **proc_arr;
-  int i;
   
-  proc_arr = results->process_info.arr[pid];
-  if(!proc_arr) {
-    return NULL;
-  }
-  
-  /* Iterate over the processes and grab the one whose
-     hash matches */
-  i = 0;
-  process = proc_arr[i];
+  /* Iterate over the processes and grab the one whose name matches.
+     The hash is only there to skip most of the string compares. */
+  process = get_process_slot(pid)->latest;
   while(process) {
-    if(process->name_hash == hash) {
+    if(!process->exited && (process->name_hash == hash) &&
+       (strcmp(process->name, name) == 0)) {
       return process;
     }
-    process = proc_arr[++i];
+    process = process->prev;
   }
   
   return NULL;
 }
 
 /**
-  update_one_process_info
+  set_process_exited
   **
-  We've seen this PID before, but now the process name is different,
-  so the OS is reusing PIDs. Add this PID to the array in `process_info`.
+  Puts a live process on the `exited` list. It's kept until its last
+  interval has been output.
 **/
-static void update_one_process_info(uint32_t pid, char *name, uint32_t hash, int num_procs) {
+static void set_process_exited(process_t *process) {
+  process->exited = 1;
+  process->exit_interval = results->interval_num;
+  process->next_exited = results->process_info.exited;
+  results->process_info.exited = process;
+}
+
+/**
+  update_process_info
+  **
+  Records that `name` is using this PID, in the given cgroup, as of `gen`.
+  If we've seen this PID before with a different name, either the OS is
+  reusing PIDs, or the process renamed itself, so add a new process.
+**/
+static void update_process_info(uint32_t pid, char *name, uint32_t hash, uint64_t cgroup_id,
+                                uint64_t gen) {
+  process_slot_t *slot;
   process_t *process;
   
-  /* Here, we're adding 2 additional elements because
-     we need one for the NULL terminator, and another
-     for the new process. */
-  results->process_info.arr[pid] = realloc(results->process_info.arr[pid],
-                                           (num_procs + 2) * sizeof(process_t *));
-  process = malloc(sizeof(process_t));
-  if(!process) {
-    fprintf(stderr, "Failed to allocate memory! Aborting.\n");
-    exit(1);
+  /* A process can move between cgroups without changing its name. It
+     can also exec something with the same name, and if this arrived
+     before the exit of the old image, it's the same row from now on. */
+  process = get_process_info(pid, name, hash);
+  if(process) {
+    process->cgroup_id = cgroup_id;
+    if(gen > process->gen) {
+      process->gen = gen;
+    }
+    return;
+  }
+  
+  /* The BPF program only remembers the last name that it sent for this
+     PID, so this one replaces the others, e.g. after prctl(PR_SET_NAME),
+     and no exit will come for them. If one of them is newer, this
+     record is the one that arrived late. */
+  for(process = get_process_slot(pid)->latest; process; process = process->prev) {
+    if(process->exited) continue;
+    if(process->gen > gen) {
+      return;
+    }
+    set_process_exited(process);
+  }
+  
+  /* Make room first, since growing moves the entries */
+  grow_process_info();
+  slot = get_process_slot(pid);
+  if(!slot->latest) {
+    slot->pid = pid;
+    results->process_info.count++;
   }
-  process->name = strdup(name);
+  
+  process = results->process_info.free_procs;
+  if(process) {
+    results->process_info.free_procs = process->next_exited;
+  } else {
+    process = arena_alloc(sizeof(process_t));
+  }
+  memset(process, 0, sizeof(process_t));
+  results->process_info.num_procs++;
+  process->pid = pid;
+  process->name = intern_name(name, hash);
   process->name_hash = hash;
+  process->cgroup_id = cgroup_id;
+  process->gen = gen;
   process->index = results->pid_ctr++;
-  results->process_info.arr[pid][num_procs] = process;
-  results->process_info.arr[pid][num_procs + 1] = NULL;
+  process->prev = slot->latest;
+  slot->latest = process;
 }
 
 /**
-  add_process_info
+  mark_process_exited
   **
-  If we haven't seen this PID at all, create a new array of process_t pointers.
+  Records that the live process with this PID and name has exited. If
+  we've already been sent a newer name record for it, the exit is for
+  the image that it replaced, and arrived late.
 **/
-static void add_process_info(uint32_t pid, char *name, uint32_t hash) {
+static void mark_process_exited(uint32_t pid, char *name, uint32_t hash, uint64_t gen) {
   process_t *process;
   
-  /* Allocate the new process_t */
-  process = malloc(sizeof(process_t));
-  if(!process) {
-    fprintf(stderr, "Failed to allocate memory! Aborting.\n");
-    exit(1);
+  process = get_process_info(pid, name, hash);
+  if(!process || (gen < process->gen)) {
+    return;
   }
-  process->name = strdup(name);
-  process->name_hash = hash;
-  process->index = results->pid_ctr++;
+  set_process_exited(process);
+}
+
+/**
+  delete_process_slot
+  **
+  Empties a slot in the PID table. Later entries in the same probe
+  sequence are shifted back, so that lookups don't stop early.
+**/
+static void delete_process_slot(process_slot_t *slot) {
+  process_arr_t *info;
+  uint32_t i, j, home;
   
-  /* Now add that process_t to the process_arr_t struct */
-  results->process_info.arr[pid] = (process_t **) malloc(sizeof(process_t *) * 2);
-  results->process_info.arr[pid][0] = process;
-  results->process_info.arr[pid][1] = NULL;
+  info = &(results->process_info);
+  i = slot - info->slots;
+  j = i;
+  while(1) {
+    j = (j + 1) & (info->size - 1);
+    if(!info->slots[j].latest) {
+      break;
+    }
+    
+    /* Can the entry at j move back to i? Only if its home isn't in (i, j]. */
+    home = hash_process_slot(info->slots[j].pid, info->size);
+    if((i <= j) ? ((home <= i) || (home > j)) : ((home <= i) && (home > j))) {
+      info->slots[i] = info->slots[j];
+      i = j;
+    }
+  }
+  info->slots[i].latest = NULL;
+  info->slots[i].pid = 0;
+  info->count--;
 }
 
-static void update_process_info(uint32_t pid, char *name, uint32_t hash) {
-  int num_procs;
-  process_t *process;
+static void prune_cgroup_paths(uint64_t interval_num);
+
+/**
+  retire_exited_processes
+  **
+  Frees the processes that exited before `interval_num`, whose last
+  interval has already been output, along with their names and any
+  cgroup paths that no process uses anymore. The snapshot of
+  `interval_num` may still point to those, so they're only buried.
+  Must be called with the write lock.
+**/
+static void retire_exited_processes(uint64_t interval_num) {
+  process_t **link, *process, **chain;
+  process_slot_t *slot;
   
-  /* First, get the array of process_t pointers. */
-  num_procs = get_num_process_info(pid);
-  if(num_procs > 0) {
-    process = get_process_info(pid, hash);
-    if(!process) {
-      update_one_process_info(pid, name, hash, num_procs);
+  link = &(results->process_info.exited);
+  while(*link) {
+    process = *link;
+    if(process->exit_interval >= interval_num) {
+      link = &(process->next_exited);
+      continue;
+    }
+    *link = process->next_exited;
+    
+    /* Unlink it from its PID's list */
+    slot = get_process_slot(process->pid);
+    chain = &(slot->latest);
+    while(*chain && (*chain != process)) {
+      chain = &((*chain)->prev);
+    }
+    if(*chain) {
+      *chain = process->prev;
     }
+    if(!slot->latest) {
+      delete_process_slot(slot);
+    }
+    
+    release_name(process->name, interval_num);
+    process->next_exited = results->process_info.free_procs;
+    results->process_info.free_procs = process;
+    results->process_info.num_procs--;
+  }
+  
+  prune_cgroup_paths(interval_num);
+}
+
+/**
+  deinit_process_info
+  **
+  Frees the PID table, the name table, the cgroup cache, and everything
+  in the arena and on the graveyard.
+**/
+static void deinit_process_info() {
+  arena_chunk_t *chunk, *next;
+  uint32_t i;
+  
+  for(chunk = results->process_info.arena; chunk; chunk = next) {
+    next = chunk->next;
+    free(chunk);
+  }
+  for(i = 0; i < results->process_info.names_size; i++) {
+    if(results->process_info.names[i]) {
+      free(INTERNED_STR(results->process_info.names[i]));
+    }
+  }
+  for(i = 0; i < results->cgroup_info.size; i++) {
+    if(results->cgroup_info.entries[i].path) {
+      free(INTERNED_STR(results->cgroup_info.entries[i].path));
+    }
+  }
+  free_dead_strs(UINT64_MAX);
+  free(results->process_info.names);
+  free(results->process_info.slots);
+  free(results->cgroup_info.entries);
+  if(results->cgroup_info.root_fd > 0) {
+    close(results->cgroup_info.root_fd);
+  }
+}
+
+/*******************************************************************************
+*                                  CGROUPS
+*******************************************************************************/
+
+/* The handle type that cgroupfs uses, whose handle is just the cgroup's ID */
+#define FILEID_KERNFS 0xfe
+
+#define CGROUPS_INITIAL_SIZE 64
+
+static uint32_t hash_cgroup(uint64_t id, uint32_t size) {
+  return (uint32_t) ((id * 11400714819323198485ULL) >> 32) & (size - 1);
+}
+
+/**
+  resolve_cgroup_path
+  **
+  Finds the path of the cgroup with the given ID, relative to the cgroup2
+  mount, by opening it by its file handle. Falls back to the bare ID if
+  that doesn't work, e.g. if the cgroup is already gone.
+**/
+static char *resolve_cgroup_path(uint64_t id) {
+  char buf[sizeof(struct file_handle) + sizeof(uint64_t)] __attribute__((aligned(8)));
+  struct file_handle *handle;
+  char link[64], path[PATH_MAX], *rel;
+  ssize_t len;
+  int fd;
+  
+  len = -1;
+  if(!results->cgroup_info.root_fd) {
+    results->cgroup_info.root_fd = open(CGROUP_ROOT, O_RDONLY | O_DIRECTORY);
+  }
+  if(results->cgroup_info.root_fd > 0) {
+    handle = (struct file_handle *) buf;
+    handle->handle_bytes = sizeof(uint64_t);
+    handle->handle_type = FILEID_KERNFS;
+    memcpy(handle->f_handle, &id, sizeof(uint64_t));
+    fd = open_by_handle_at(results->cgroup_info.root_fd, handle, O_RDONLY | O_DIRECTORY);
+    if(fd >= 0) {
+      snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+      len = readlink(link, path, sizeof(path) - 1);
+      close(fd);
+    }
+  }
+  
+  if(len < 0) {
+    snprintf(path, sizeof(path), "cgroup:%" PRIu64, id);
+    rel = path;
   } else {
-    add_process_info(pid, name, hash);
+    path[len] = '\0';
+    rel = path;
+    if(strncmp(path, CGROUP_ROOT, strlen(CGROUP_ROOT)) == 0) {
+      rel = path + strlen(CGROUP_ROOT);
+      if(!*rel) {
+        rel = "/";
+      }
+    }
+  }
+  
+  return alloc_interned_str(rel, 0);
+}
+
+/**
+  find_cgroup_entry
+  **
+  Returns the index of the entry for this ID in `entries`, or of the
+  empty entry where it would go.
+**/
+static uint32_t find_cgroup_entry(cgroup_t *entries, uint32_t size, uint64_t id) {
+  uint32_t i;
+  
+  i = hash_cgroup(id, size);
+  while(entries[i].path && (entries[i].id != id)) {
+    i = (i + 1) & (size - 1);
+  }
+  
+  return i;
+}
+
+/**
+  find_cgroup_path
+  **
+  Returns the cached path of the cgroup with the given ID, or NULL if
+  it hasn't been resolved yet.
+**/
+static char *find_cgroup_path(uint64_t id) {
+  cgroup_arr_t *info;
+  
+  info = &(results->cgroup_info);
+  if(!info->size) {
+    return NULL;
   }
+  return info->entries[find_cgroup_entry(info->entries, info->size, id)].path;
+}
+
+/**
+  get_cgroup_path
+  **
+  Returns the path of the cgroup with the given ID, looking it up
+  the first time that it's seen. That takes a few syscalls, so it's
+  called without the results lock; only the main thread uses the cache.
+**/
+static char *get_cgroup_path(uint64_t id) {
+  cgroup_arr_t *info;
+  cgroup_t *old_entries;
+  uint32_t old_size, i, n;
+  
+  info = &(results->cgroup_info);
   
-  /* Update the maximum PID we've seen */
-  if(pid > results->process_info.max_pid) {
-    results->process_info.max_pid = pid;
+  /* Keep the table at most half full */
+  if(info->count * 2 >= info->size) {
+    old_entries = info->entries;
+    old_size = info->size;
+    info->size = old_size ? old_size * 2 : CGROUPS_INITIAL_SIZE;
+    info->entries = calloc(info->size, sizeof(cgroup_t));
+    if(!info->entries) {
+      fprintf(stderr, "Failed to allocate memory! Aborting.\n");
+      exit(1);
+    }
+    for(n = 0; n < old_size; n++) {
+      if(!old_entries[n].path) continue;
+      i = hash_cgroup(old_entries[n].id, info->size);
+      while(info->entries[i].path) {
+        i = (i + 1) & (info->size - 1);
+      }
+      info->entries[i] = old_entries[n];
+    }
+    free(old_entries);
   }
+  
+  i = hash_cgroup(id, info->size);
+  while(info->entries[i].path) {
+    if(info->entries[i].id == id) {
+      return info->entries[i].path;
+    }
+    i = (i + 1) & (info->size - 1);
+  }
+  
+  info->entries[i].id = id;
+  info->entries[i].path = resolve_cgroup_path(id);
+  info->count++;
+  
+  return info->entries[i].path;
 }
 
-static int get_interval_proc_arr_index(uint32_t pid) {
+/**
+  prune_cgroup_paths
+  **
+  Once the cache has doubled since it was last pruned, rebuilds it with
+  only the cgroups of processes that are still in the PID table, and
+  buries the other paths. Called when processes are retired.
+**/
+static void prune_cgroup_paths(uint64_t interval_num) {
+  cgroup_arr_t *info;
+  cgroup_t *old_entries;
+  process_t *process;
+  uint32_t n, i, j;
+  
+  info = &(results->cgroup_info);
+  if((info->count < CGROUPS_INITIAL_SIZE / 2) || (info->count < info->live_count * 2)) {
+    return;
+  }
+  
+  old_entries = info->entries;
+  info->entries = calloc(info->size, sizeof(cgroup_t));
+  if(!info->entries) {
+    fprintf(stderr, "Failed to allocate memory! Aborting.\n");
+    exit(1);
+  }
+  info->count = 0;
+  
+  for(n = 0; n < results->process_info.size; n++) {
+    process = results->process_info.slots[n].latest;
+    for(; process; process = process->prev) {
+      j = find_cgroup_entry(info->entries, info->size, process->cgroup_id);
+      if(info->entries[j].path) continue;
+      i = find_cgroup_entry(old_entries, info->size, process->cgroup_id);
+      if(!old_entries[i].path) continue;
+      info->entries[j] = old_entries[i];
+      info->count++;
+    }
+  }
+  
+  for(i = 0; i < info->size; i++) {
+    if(!old_entries[i].path) continue;
+    j = find_cgroup_entry(info->entries, info->size, old_entries[i].id);
+    if(!info->entries[j].path) {
+      bury_interned_str(old_entries[i].path, interval_num);
+    }
+  }
+  free(old_entries);
+  info->live_count = info->count;
+}
+
+#define PID_INDEX_INITIAL_SIZE 128
+
+static uint32_t hash_pid(uint32_t pid, uint32_t size) {
+  /* Fibonacci hashing; `size` is a power of two */
+  return (pid * 2654435769U) & (size - 1);
+}
+
+/**
+  insert_pid_index: Adds a PID to the index, without checking if it's
+  already there. There must be at least one free entry.
+**/
+static void insert_pid_index(interval_results_t *interval, uint32_t pid, int slot) {
+  uint32_t i;
+  
+  i = hash_pid(pid, interval->pid_index_size);
+  while(interval->pid_index[i].gen == interval->pid_index_gen) {
+    i = (i + 1) & (interval->pid_index_size - 1);
+  }
+  interval->pid_index[i].pid = pid;
+  interval->pid_index[i].slot = slot;
+  interval->pid_index[i].gen = interval->pid_index_gen;
+}
+
+/**
+  grow_pid_index: Keeps the PID index at most half full, so that probe
+  sequences stay short. Rebuilds it from this interval's PIDs.
+**/
+static void grow_pid_index(interval_results_t *interval) {
   int i;
   
+  if((interval->pid_index_size != 0) &&
+     (interval->pid_ctr * 2 < interval->pid_index_size)) {
+    return;
+  }
+  
+  if(interval->pid_index_size == 0) {
+    interval->pid_index_size = PID_INDEX_INITIAL_SIZE;
+  } else {
+    interval->pid_index_size *= 2;
+  }
+  free(interval->pid_index);
+  interval->pid_index = calloc(interval->pid_index_size, sizeof(pid_index_entry_t));
+  if(!interval->pid_index) {
+    fprintf(stderr, "Failed to allocate memory! Aborting.\n");
+    exit(1);
+  }
+  
+  /* Generation 0 marks an empty entry */
+  interval->pid_index_gen = 1;
+  for(i = 0; i < interval->pid_ctr; i++) {
+    insert_pid_index(interval, interval->pids[i], i);
+  }
+}
+
+/**
+  clear_pid_index: Empties the PID index for the next interval.
+**/
+static void clear_pid_index(interval_results_t *interval) {
+  interval->pid_index_gen++;
+  if(interval->pid_index_gen == 0) {
+    /* Wrapped around, so actually clear it */
+    memset(interval->pid_index, 0, interval->pid_index_size * sizeof(pid_index_entry_t));
+    interval->pid_index_gen = 1;
+  }
+}
+
+static int get_interval_proc_arr_index(interval_results_t *interval, uint32_t pid) {
+  pid_index_entry_t *entry;
+  uint32_t i;
+  
   /* Have we seen this PID this interval? */
-  for(i = 0; i < results->interval->pid_ctr; i++) {
-    if(results->interval->pids[i] == pid) {
-      return i;
+  i = hash_pid(pid, interval->pid_index_size);
+  while(1) {
+    entry = &(interval->pid_index[i]);
+    if(entry->gen != interval->pid_index_gen) {
+      break;
+    }
+    if(entry->pid == pid) {
+      return entry->slot;
     }
+    i = (i + 1) & (interval->pid_index_size - 1);
   }
   
   /* Increment the counter, thus choosing an index for this process
-     in the proc_* arrays. */
-  i = results->interval->pid_ctr++;
-  grow_interval_proc_arrs();
+     in the per-process arrays. */
+  i = interval->pid_ctr++;
+  grow_interval_proc_arrs(interval);
+  interval->pids[i] = pid;
+  if(!interval->procs[i]) {
+    interval->procs[i] = alloc_proc_counts();
+  }
+  
+  /* If the index grows, it's rebuilt with this PID already in it */
+  if(interval->pid_ctr * 2 >= interval->pid_index_size) {
+    grow_pid_index(interval);
+  } else {
+    entry->pid = pid;
+    entry->slot = i;
+    entry->gen = interval->pid_index_gen;
+  }
   
   return i;
 }
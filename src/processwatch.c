@@ -1,6 +1,7 @@
 /* Copyright (C) 2022 Intel Corporation */
 /* SPDX-License-Identifier: GPL-2.0-only */
 
+#define _GNU_SOURCE
 #include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,6 +10,10 @@
 #include <pthread.h>
 #include <time.h>
 #include <ctype.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
 #ifdef __aarch64__
 #include <capstone/capstone.h>
 #elif __x86_64__
@@ -19,6 +24,7 @@
 
 /* This is where results are stored */
 results_t *results = NULL;
+snapshot_t *output_snapshot = NULL;
 bpf_info_t *bpf_info = NULL;
 pthread_rwlock_t results_lock = PTHREAD_RWLOCK_INITIALIZER;
 
@@ -30,6 +36,24 @@ pthread_rwlock_t results_lock = PTHREAD_RWLOCK_INITIALIZER;
 *                                    OPTIONS
 *******************************************************************************/
 
+/* Options without a short form. These start past the range of a char. */
+enum {
+  OPT_AGGREGATE = 256,
+  OPT_RB_SHARDS,
+  OPT_OVERHEAD_BUDGET,
+  OPT_SAMPLE_RATE,
+  OPT_RB_SIZE,
+  OPT_COMM,
+  OPT_CGROUP,
+  OPT_GROUP_BY,
+  OPT_THREADS,
+  OPT_HOUSEKEEPING_CPUS,
+  OPT_SCHED_BATCH,
+  OPT_NICE,
+  OPT_DUTY_CYCLE,
+  OPT_DUTY_RANDOM,
+};
+
 static struct option long_options[] = {
   {"help",          no_argument,       0, 'h'},
   {"version",       no_argument,       0, 'v'},
@@ -45,6 +69,21 @@ static struct option long_options[] = {
   {"list",          no_argument,       0, 'l'},
   {"btf",           required_argument, 0, 'b'},
   {"all",           no_argument,       0, 'a'},
+  {"aggregate",     no_argument,       0, OPT_AGGREGATE},
+  {"rb-shards",     required_argument, 0, OPT_RB_SHARDS},
+  {"overhead-budget", required_argument, 0, OPT_OVERHEAD_BUDGET},
+  {"sample-rate",   required_argument, 0, OPT_SAMPLE_RATE},
+  {"rb-size",       required_argument, 0, OPT_RB_SIZE},
+  {"comm",          required_argument, 0, OPT_COMM},
+  {"cgroup",        required_argument, 0, OPT_CGROUP},
+  {"cpus",          required_argument, 0, 'C'},
+  {"group-by",      required_argument, 0, OPT_GROUP_BY},
+  {"threads",       no_argument,       0, OPT_THREADS},
+  {"housekeeping-cpus", required_argument, 0, OPT_HOUSEKEEPING_CPUS},
+  {"sched-batch",   no_argument,       0, OPT_SCHED_BATCH},
+  {"nice",          required_argument, 0, OPT_NICE},
+  {"duty-cycle",    required_argument, 0, OPT_DUTY_CYCLE},
+  {"duty-random",   no_argument,       0, OPT_DUTY_RANDOM},
   {0,               0,                 0, 0}
 };
 
@@ -224,22 +263,49 @@ void free_opts() {
     }
     free(pw_opts.col_strs);
   }
+  
+  for(i = 0; i < pw_opts.num_comms; i++) {
+    free(pw_opts.comms[i]);
+  }
+  free(pw_opts.comms);
+  free(pw_opts.pids);
+  free(pw_opts.cgroup_path);
+  free(pw_opts.cpu_list);
+  free(pw_opts.housekeeping_cpus);
 }
 
 int read_opts(int argc, char **argv) {
   int option_index, index, elem;
+  double secs;
   size_t size;
   int c;
 
   pw_opts.interval_time = 2;
   pw_opts.num_intervals = 0;
-  pw_opts.pid = -1;
+  pw_opts.pids = NULL;
+  pw_opts.num_pids = 0;
+  pw_opts.comms = NULL;
+  pw_opts.num_comms = 0;
+  pw_opts.cgroup_path = NULL;
+  pw_opts.cpu_list = NULL;
+  pw_opts.housekeeping_cpus = NULL;
+  pw_opts.sched_batch = 0;
+  pw_opts.nice = 0;
+  pw_opts.duty_on_ms = 0;
+  pw_opts.duty_random = 0;
+  pw_opts.group_by = GROUP_BY_PID;
+  pw_opts.threads = 0;
   pw_opts.show_mnemonics = 0;
   pw_opts.show_extensions = 0;
   pw_opts.csv = 0;
   pw_opts.btf_custom_path = NULL;
   pw_opts.debug = 0;
   pw_opts.sample_period = 100000;
+  pw_opts.aggregate = 0;
+  pw_opts.rb_shards = 1;
+  pw_opts.overhead_budget = 0;
+  pw_opts.sample_rate = 0;
+  pw_opts.rb_size_mb = 0;
 
   /* Column filters */
   pw_opts.col_strs = NULL;
@@ -250,7 +316,7 @@ int read_opts(int argc, char **argv) {
   
   while(1) {
     option_index = 0;
-    c = getopt_long(argc, argv, "hvdi:cp:ms:f:ln:b:ea",
+    c = getopt_long(argc, argv, "hvdi:cp:C:ms:f:ln:b:ea",
                     long_options, &option_index);
     if(c == -1) {
       break;
@@ -273,7 +339,8 @@ int read_opts(int argc, char **argv) {
         printf("  -i <int>    Prints results every <int> seconds.\n");
         printf("  -n <num>    Prints results for <num> intervals.\n");
         printf("  -c          Prints all results in CSV format to stdout.\n");
-        printf("  -p <pid>    Only profiles <pid>.\n");
+        printf("  -p <pid>    Can be used multiple times. Only profiles the given processes, and those matched by --comm.\n");
+        printf("  -C <cpus>   Only samples the given CPUs, as a list like '0-15,64-79'. Defaults to all of them.\n");
         printf("  -m          Displays instruction mnemonics, instead of categories.\n");
 #ifdef __x86_64__
         printf("  -e          Displays instruction extensions, instead of categories. Only for x86.\n");
@@ -287,6 +354,32 @@ int read_opts(int argc, char **argv) {
         printf("  -a          Displays a column for each category, mnemonic, or extension. This is a lot of output!\n");
         printf("  -l          Prints a list of all available categories, mnemonics, or extensions.\n");
         printf("  -d          Prints only debug information.\n");
+        printf("  --aggregate Counts samples in the kernel, and reads them once per interval. Lowers overhead at high sampling rates.\n");
+        printf("  --rb-shards <num>\n");
+        printf("              Splits the ringbuffer into <num> shards, each read by its own thread. CPUs are grouped evenly between the shards.\n");
+        printf("  --overhead-budget <pct>\n");
+        printf("              Adjusts the sampling period each interval to keep processwatch's CPU usage near <pct> percent of one CPU. -s sets the starting period.\n");
+        printf("  --sample-rate <num>\n");
+        printf("              Adjusts the sampling period each interval to collect about <num> samples per second. -s sets the starting period.\n");
+        printf("  --comm <prefix>\n");
+        printf("              Can be used multiple times. Only profiles processes whose names start with <prefix>, and those given with -p.\n");
+        printf("  --cgroup <path>\n");
+        printf("              Only samples while tasks in the given cgroup are running. Relative paths are under /sys/fs/cgroup.\n");
+        printf("  --group-by <pid|cgroup>\n");
+        printf("              Prints one row per process (the default), or one row per cgroup. With cgroup, the PID column is the number of processes.\n");
+        printf("  --threads   Prints one row per thread, instead of per process. Threads are named <process>/<thread>.\n");
+        printf("  --housekeeping-cpus <cpus>\n");
+        printf("              Runs all of Process Watch's own threads on the given CPUs, as a list like '0-1'. Keeps them off of the CPUs being profiled.\n");
+        printf("  --sched-batch\n");
+        printf("              Runs Process Watch's own threads with the SCHED_BATCH scheduling policy.\n");
+        printf("  --nice <num>\n");
+        printf("              Runs Process Watch's own threads with the given nice value.\n");
+        printf("  --duty-cycle <secs>\n");
+        printf("              Only samples for the first <secs> seconds of each interval. Sample counts are scaled up to make up for the rest.\n");
+        printf("  --duty-random\n");
+        printf("              With --duty-cycle, samples at a random offset into each interval, instead of at its start.\n");
+        printf("  --rb-size <MB>\n");
+        printf("              Sets the total size of the ringbuffer (or perf buffers) in megabytes. Defaults to about one interval of samples from every CPU.\n");
         return -1;
         break;
       case 'b':
@@ -310,7 +403,13 @@ int read_opts(int argc, char **argv) {
         pw_opts.csv = 1;
         break;
       case 'p':
-        pw_opts.pid = (int) strtoul(optarg, NULL, 10);
+        if(pw_opts.num_pids == MAX_FILTER_PIDS) {
+          fprintf(stderr, "Can't profile more than %d PIDs.\n", MAX_FILTER_PIDS);
+          return -1;
+        }
+        pw_opts.num_pids++;
+        pw_opts.pids = (int *) realloc(pw_opts.pids, sizeof(int) * pw_opts.num_pids);
+        pw_opts.pids[pw_opts.num_pids - 1] = (int) strtoul(optarg, NULL, 10);
         break;
       case 'm':
         pw_opts.show_mnemonics = 1;
@@ -338,6 +437,118 @@ int read_opts(int argc, char **argv) {
       case 'd':
         pw_opts.debug = 1;
         break;
+      case OPT_AGGREGATE:
+#ifdef INSNPROF_LEGACY_PERF_BUFFER
+        fprintf(stderr, "Aggregation requires the ringbuffer interface, which this build doesn't use.\n");
+        return -1;
+#endif
+        pw_opts.aggregate = 1;
+        break;
+      case OPT_RB_SHARDS:
+#ifdef INSNPROF_LEGACY_PERF_BUFFER
+        fprintf(stderr, "Ringbuffer shards require the ringbuffer interface, which this build doesn't use.\n");
+        return -1;
+#endif
+        pw_opts.rb_shards = (int) strtoul(optarg, NULL, 10);
+        if(pw_opts.rb_shards < 1) {
+          pw_opts.rb_shards = 1;
+        }
+        break;
+      case OPT_OVERHEAD_BUDGET:
+        pw_opts.overhead_budget = strtod(optarg, NULL);
+        if(pw_opts.overhead_budget <= 0) {
+          fprintf(stderr, "The overhead budget must be a positive percentage.\n");
+          return -1;
+        }
+        break;
+      case OPT_SAMPLE_RATE:
+        pw_opts.sample_rate = strtoul(optarg, NULL, 10);
+        if(pw_opts.sample_rate == 0) {
+          fprintf(stderr, "The sample rate must be a positive number of samples per second.\n");
+          return -1;
+        }
+        break;
+      case OPT_RB_SIZE:
+        pw_opts.rb_size_mb = strtoul(optarg, NULL, 10);
+        if(pw_opts.rb_size_mb == 0) {
+          fprintf(stderr, "The ringbuffer size must be a positive number of megabytes.\n");
+          return -1;
+        }
+        break;
+      case OPT_COMM:
+        if(pw_opts.num_comms == MAX_COMM_PREFIXES) {
+          fprintf(stderr, "Can't give more than %d process name prefixes.\n", MAX_COMM_PREFIXES);
+          return -1;
+        }
+        if((strlen(optarg) == 0) || (strlen(optarg) >= TASK_COMM_LEN)) {
+          fprintf(stderr, "Process name prefixes must be 1 to %d characters long.\n", TASK_COMM_LEN - 1);
+          return -1;
+        }
+        pw_opts.num_comms++;
+        pw_opts.comms = (char **) realloc(pw_opts.comms, sizeof(char *) * pw_opts.num_comms);
+        pw_opts.comms[pw_opts.num_comms - 1] = strdup(optarg);
+        break;
+      case OPT_CGROUP:
+        if(pw_opts.cgroup_path) {
+          fprintf(stderr, "Multiple cgroups specified! Aborting.\n");
+          exit(1);
+        }
+        if(optarg[0] == '/') {
+          pw_opts.cgroup_path = strdup(optarg);
+        } else {
+          size = strlen(CGROUP_ROOT) + strlen(optarg) + 2;
+          pw_opts.cgroup_path = calloc(size, sizeof(char));
+          snprintf(pw_opts.cgroup_path, size, "%s/%s", CGROUP_ROOT, optarg);
+        }
+        break;
+      case 'C':
+        if(pw_opts.cpu_list) {
+          fprintf(stderr, "Multiple CPU lists specified! Aborting.\n");
+          exit(1);
+        }
+        pw_opts.cpu_list = strdup(optarg);
+        break;
+      case OPT_GROUP_BY:
+        if(strcmp(optarg, "pid") == 0) {
+          pw_opts.group_by = GROUP_BY_PID;
+        } else if(strcmp(optarg, "cgroup") == 0) {
+          pw_opts.group_by = GROUP_BY_CGROUP;
+        } else {
+          fprintf(stderr, "Can only group by 'pid' or 'cgroup'.\n");
+          return -1;
+        }
+        break;
+      case OPT_THREADS:
+        pw_opts.threads = 1;
+        break;
+      case OPT_HOUSEKEEPING_CPUS:
+        if(pw_opts.housekeeping_cpus) {
+          fprintf(stderr, "Multiple housekeeping CPU lists specified! Aborting.\n");
+          exit(1);
+        }
+        pw_opts.housekeeping_cpus = strdup(optarg);
+        break;
+      case OPT_SCHED_BATCH:
+        pw_opts.sched_batch = 1;
+        break;
+      case OPT_DUTY_CYCLE:
+        secs = strtod(optarg, NULL);
+        pw_opts.duty_on_ms = (secs > 0) ? secs * 1000 : 0;
+        if(pw_opts.duty_on_ms == 0) {
+          fprintf(stderr, "The duty cycle must be a positive number of seconds.\n");
+          return -1;
+        }
+        break;
+      case OPT_DUTY_RANDOM:
+        pw_opts.duty_random = 1;
+        break;
+      case OPT_NICE:
+        pw_opts.nice = strtol(optarg, NULL, 10);
+        if((pw_opts.nice < -20) || (pw_opts.nice > 19)) {
+          fprintf(stderr, "The nice value must be between -20 and 19.\n");
+          return -1;
+        }
+        break;
       case '?':
         return -1;
       default:
@@ -350,6 +561,20 @@ int read_opts(int argc, char **argv) {
     exit(0);
   }
   
+  if((pw_opts.overhead_budget > 0) && (pw_opts.sample_rate > 0)) {
+    fprintf(stderr, "Only one of --overhead-budget and --sample-rate can be used.\n");
+    return -1;
+  }
+  
+  if(pw_opts.duty_on_ms >= pw_opts.interval_time * 1000ULL) {
+    fprintf(stderr, "The duty cycle must be shorter than the interval.\n");
+    return -1;
+  }
+  if(pw_opts.duty_random && !pw_opts.duty_on_ms) {
+    fprintf(stderr, "--duty-random needs --duty-cycle.\n");
+    return -1;
+  }
+  
   if(pw_opts.all) {
     
     /* Set the number of columns */
@@ -406,178 +631,401 @@ int read_opts(int argc, char **argv) {
 }
 
 /*******************************************************************************
-*                              THREAD AND SIGNALS
+*                                  MAIN LOOP
 *******************************************************************************/
 
-pthread_t ui_thread_id;
-
-int interval_signal;
-static int stopping = 0;
-timer_t interval_timer;
-double interval_target_time;
-struct timespec interval_start,
-                interval_end;
-                
-void ui_thread_stop(int s) {
-  timer_delete(interval_timer);
-  stopping = 1;
-}
-                
-void ui_thread_interval(int s) {
+static atomic_int stopping = 0;
+static int epoll_fd = -1,
+           timer_fd = -1,
+           signal_fd = -1;
+
+/**
+  run_interval: Ends the current interval, and hands it to the output thread.
+    Runs on the main thread, which is the first shard's consumer.
+*/
+void run_interval() {
+  snapshot_t *snapshot;
+  uint64_t num_samples, lost;
+  double ringbuf_used, duty_scale;
+  
+  /* Stop sampling until the next window, if we're duty cycling */
+  duty_scale = end_duty_window();
+  
+  /* How full the ringbuffers got, before the consumers drain them */
+  ringbuf_used = get_max_ringbuf_used();
+  
+  /* Consumers take the lock to record process names, so
+     wait for them to let go of their buffers first. */
+  swap_consumer_buffers(&(bpf_info->consumers[0]));
+  
   if(pthread_rwlock_wrlock(&results_lock) != 0) {
     fprintf(stderr, "Failed to grab the write lock! Aborting.\n");
     exit(1);
   }
   
-  calculate_interval_percentages();
-
-  if(pw_opts.debug) {
-    results->interval->ringbuf_used = get_ringbuf_used();
-  }
-
-  if(sorted_interval) {
-    free_sorted_interval();
+  merge_consumer_results();
+  
+#ifndef INSNPROF_LEGACY_PERF_BUFFER
+  if(pw_opts.aggregate) {
+    drain_insn_agg();
   }
+#endif
   
-  /* Display the results */
-  if(pw_opts.csv) {
-    print_csv_interval(stdout);
-  } else {
-    update_screen(&sorted_interval);
+  if(pw_opts.debug) {
+    update_ringbuf_used();
   }
+  read_insn_stats();
   
-  /* Clear out the events to start another interval */
-  clear_interval_results();
+  /* Start another interval */
+  results->interval->sample_period = bpf_info->sample_period;
+  results->interval->num_cpus_attached = get_num_attached_cpus();
+  results->interval->duty_scale = duty_scale;
+  num_samples = results->interval->num_samples;
+  lost = results->interval->stats.lost;
+  snapshot = take_snapshot();
   
   if(pthread_rwlock_unlock(&results_lock) != 0) {
     fprintf(stderr, "Failed to release the lock! Aborting.\n");
     exit(1);
   }
   
+  /* The output thread displays the results */
+  resolve_snapshot_cgroups(snapshot);
+  publish_snapshot(snapshot);
+  
+  /* The new period applies to the next interval */
+  if(governor_enabled()) {
+    update_governor(num_samples, lost, ringbuf_used, duty_scale);
+  }
+  
+  /* Follow CPUs going on and offline */
+  update_online_cpus();
+  
+  if(duty_cycle_enabled()) {
+    schedule_duty_window();
+  }
+  
   /* If the user specified a number of intervals to run */
   if(results->interval_num == pw_opts.num_intervals) {
-    ui_thread_stop(SIGTERM);
+    stopping = 1;
+  }
+}
+
+static int add_epoll_fd(int epfd, int fd) {
+  struct epoll_event event = {0};
+  
+  event.events = EPOLLIN;
+  event.data.fd = fd;
+  if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) != 0) {
+    fprintf(stderr, "Failed to add a file descriptor to epoll: %s\n", strerror(errno));
+    return -1;
   }
+  
+  return 0;
 }
 
 /**
-  init_interval_signal: Sets up the signal handler to trigger an interval.
+  init_main_loop: Sets up everything that the main thread waits on:
+    the first shard (or the perf buffer), a timerfd that ticks each
+    interval, a signalfd for SIGTERM, and the duty cycle's timerfd. Must be called before any
+    other threads are created, so that they all block SIGTERM.
 */
-int init_interval_signal() {
-  struct sigevent sev;
+int init_main_loop() {
   struct itimerspec its;
-  struct sigaction sa;
-  sigset_t interval_mask;
-  pid_t tid;
-  
-  interval_signal = SIGRTMIN;
-  
-  /* Set up a signal handler for the master.
-     The call to sigaddset here blocks the stop signal until an interval is completed. */
-  sa.sa_flags = 0;
-  sa.sa_handler = ui_thread_interval;
-  sigemptyset(&sa.sa_mask);
-  if(sigaction(interval_signal, &sa, NULL) == -1) {
-    fprintf(stderr, "Error creating interval signal handler. Aborting.\n");
-    exit(1);
+  sigset_t mask;
+  int data_fd;
+  
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGTERM);
+  if(sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
+    fprintf(stderr, "Error blocking SIGTERM. Aborting.\n");
+    return -1;
   }
-
-  /* Block the interval signal */
-  sigemptyset(&interval_mask);
-  sigaddset(&interval_mask, interval_signal);
-  if(sigprocmask(SIG_SETMASK, &interval_mask, NULL) == -1) {
-    fprintf(stderr, "Error blocking signal. Aborting.\n");
-    exit(1);
+  signal_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+  if(signal_fd < 0) {
+    fprintf(stderr, "Error creating a signalfd: %s\n", strerror(errno));
+    return -1;
   }
-
-  /* Create the interval timer */
-  tid = syscall(SYS_gettid);
-  sev.sigev_notify = SIGEV_THREAD_ID;
-  sev.sigev_signo = interval_signal;
-  sev.sigev_value.sival_ptr = &interval_timer;
-  sev._sigev_un._tid = tid;
-  if(timer_create(CLOCK_REALTIME, &sev, &interval_timer) == -1) {
-    fprintf(stderr, "Error creating timer. Aborting.\n");
-    exit(1);
+  
+  timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  if(timer_fd < 0) {
+    fprintf(stderr, "Error creating timer: %s\n", strerror(errno));
+    return -1;
   }
-
-  /* Set the interval timer */
   its.it_value.tv_sec     = pw_opts.interval_time;
   its.it_value.tv_nsec    = 0;
   its.it_interval.tv_sec  = its.it_value.tv_sec;
   its.it_interval.tv_nsec = its.it_value.tv_nsec;
-  if(timer_settime(interval_timer, 0, &its, NULL) == -1) {
-    fprintf(stderr, "Error setting the timer. Aborting.\n");
-    exit(1);
+  if(timerfd_settime(timer_fd, 0, &its, NULL) != 0) {
+    fprintf(stderr, "Error setting the timer: %s\n", strerror(errno));
+    return -1;
   }
   
-  /* Initialize the current time so that our first interval
-     knows how long it took */
-  clock_gettime(CLOCK_MONOTONIC, &(interval_end));
+#ifdef INSNPROF_LEGACY_PERF_BUFFER
+  data_fd = perf_buffer__epoll_fd(bpf_info->pb);
+#else
+  data_fd = ring__map_fd(ring_buffer__ring(bpf_info->rb, 0));
+#endif
   
-  /* Unblock the interval signal */
-  if(sigprocmask(SIG_UNBLOCK, &interval_mask, NULL) == -1) {
-    fprintf(stderr, "Error unblocking signal. Aborting.\n");
-    exit(1);
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if(epoll_fd < 0) {
+    fprintf(stderr, "Error creating epoll instance: %s\n", strerror(errno));
+    return -1;
   }
-
+  if((add_epoll_fd(epoll_fd, data_fd) != 0) ||
+     (add_epoll_fd(epoll_fd, timer_fd) != 0) ||
+     (add_epoll_fd(epoll_fd, signal_fd) != 0)) {
+    return -1;
+  }
+  
+  /* The first window starts along with the first interval */
+  if(duty_cycle_enabled()) {
+    if((init_duty_cycle() < 0) ||
+       (add_epoll_fd(epoll_fd, duty_fd) != 0)) {
+      return -1;
+    }
+  }
+  
   return 0;
 }
 
+void deinit_main_loop() {
+  if(epoll_fd >= 0) close(epoll_fd);
+  if(timer_fd >= 0) close(timer_fd);
+  if(signal_fd >= 0) close(signal_fd);
+  deinit_duty_cycle();
+}
+
 /**
-  ui_thread_main: This is the function for the profiling thread.
-    It does some setup, then triggers a profiling interval at a given
-    rate.
+  consume_samples: Reads everything that's waiting in the main thread's
+    ringbuffer shard, or in the perf buffer.
 */
-void *ui_thread_main(void *a) {
-  int sig;
-  sigset_t mask;
+static int consume_samples(consumer_t *consumer) {
+  int err;
   
-  init_interval_signal();
+  consumer_begin_batch(consumer);
+#ifdef INSNPROF_LEGACY_PERF_BUFFER
+  err = perf_buffer__consume(bpf_info->pb);
+#else
+  err = ring__consume(ring_buffer__ring(bpf_info->rb, 0));
   
-  /* Wait for the user to exit */
-  sigemptyset(&mask);
-  sigaddset(&mask, SIGTERM);
-  if(sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
-    fprintf(stderr, "Error blocking SIGTERM. Aborting.\n");
-    exit(1);
+  /* The rest is read on the next pass through the main loop */
+  if(err == CONSUMER_BATCH_DONE) {
+    err = 0;
   }
-  while(sigwait(&mask, &sig) == 0) {
-    if(sig == SIGTERM) {
+#endif
+  consumer_end_batch(consumer);
+  
+  return err;
+}
+
+/**
+  main_loop: Sleeps until there are samples to read, an interval ends,
+    or we get SIGTERM.
+*/
+int main_loop() {
+  struct epoll_event events[4];
+  struct signalfd_siginfo siginfo;
+  consumer_t *consumer;
+  uint64_t expirations;
+  int i, n, err;
+  
+  err = 0;
+  consumer = &(bpf_info->consumers[0]);
+  atomic_store(&consumer->running, 1);
+  while(stopping == 0) {
+    n = epoll_wait(epoll_fd, events, 4, -1);
+    if(n < 0) {
+      if(errno == EINTR) continue;
+      fprintf(stderr, "Failed to wait for events: %s\n", strerror(errno));
+      err = -1;
+      break;
+    }
+    
+    /* Read samples first, so that they count towards an interval that's ending */
+    err = consume_samples(consumer);
+    if(err < 0) {
+      fprintf(stderr, "Failed to read samples: %d\n", err);
       break;
     }
+    err = 0;
+    
+    for(i = 0; i < n; i++) {
+      if(events[i].data.fd == timer_fd) {
+        if(read(timer_fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+          run_interval();
+        }
+      } else if(events[i].data.fd == signal_fd) {
+        if(read(signal_fd, &siginfo, sizeof(siginfo)) == sizeof(siginfo)) {
+          stopping = 1;
+        }
+      } else if(events[i].data.fd == duty_fd) {
+        handle_duty_timer();
+      }
+    }
   }
+  atomic_store(&consumer->running, 0);
   
-  ui_thread_stop(SIGTERM);
-  
-  return NULL;
+  return err;
 }
 
+/*******************************************************************************
+*                                OUTPUT THREAD
+*******************************************************************************/
+
+pthread_t output_thread_id;
+static int output_thread_started = 0;
+
 /**
-  start_ui_thread: Sets up the stop signal and creates the profiling thread.
+  output_thread_main: Displays each interval's snapshot. Writing to stdout
+    can block, so this is kept off of the threads that collect samples.
 */
-int start_ui_thread() {
-  int retval;
-  sigset_t mask;
-  
-  /* The main thread should block SIGTERM, so that all
-     SIGTERMs go to the UI thread. */
-  sigemptyset(&mask);
-  sigaddset(&mask, SIGTERM);
-  if(sigprocmask(SIG_SETMASK, &mask, NULL) == -1) {
-    fprintf(stderr, "Error blocking signal. Aborting.\n");
-    exit(1);
+void *output_thread_main(void *a) {
+  while((output_snapshot = wait_snapshot())) {
+    if(sorted_interval) {
+      free_sorted_interval();
+    }
+    
+    if(pw_opts.csv) {
+      print_csv_interval(stdout);
+    } else {
+      update_screen(&sorted_interval);
+    }
+    
+    release_snapshot(output_snapshot);
   }
   
-  retval = pthread_create(&ui_thread_id, NULL, &ui_thread_main, NULL);
+  return NULL;
+}
+
+int start_output_thread() {
+  int retval;
+  
+  retval = pthread_create(&output_thread_id, NULL, &output_thread_main, NULL);
   if(retval != 0) {
     fprintf(stderr, "Failed to call pthread_create. Something is very wrong. Aborting.\n");
     return -1;
   }
+  output_thread_started = 1;
+  
+  return 0;
+}
+
+/**
+  stop_output_thread: Waits for the output thread to display
+    the last snapshot, then exit.
+*/
+void stop_output_thread() {
+  uint64_t dropped;
+  
+  if(!output_thread_started) {
+    return;
+  }
+  close_snapshots();
+  pthread_join(output_thread_id, NULL);
+  output_thread_started = 0;
+  
+  dropped = get_dropped_snapshots();
+  if(dropped) {
+    fprintf(stderr, "Dropped %" PRIu64 " intervals because output fell behind.\n", dropped);
+  }
+}
+
+/*******************************************************************************
+*                               CONSUMER THREADS
+*******************************************************************************/
+
+#ifndef INSNPROF_LEGACY_PERF_BUFFER
+
+static int num_consumer_threads = 0;
+
+/**
+  consumer_thread_main: Drains one ringbuffer shard until we're stopped.
+    It sleeps until BPF wakes it up, or until the main thread
+    needs it to swap buffers or stop.
+*/
+void *consumer_thread_main(void *a) {
+  struct epoll_event events[2];
+  consumer_t *consumer;
+  struct ring *ring;
+  uint64_t wakeups;
+  int epfd, n;
+  
+  consumer = a;
+  ring = ring_buffer__ring(bpf_info->rb, consumer->index);
+  
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  if(epfd < 0) {
+    fprintf(stderr, "Error creating epoll instance: %s\n", strerror(errno));
+    return NULL;
+  }
+  if((add_epoll_fd(epfd, ring__map_fd(ring)) != 0) ||
+     (add_epoll_fd(epfd, consumer->wake_fd) != 0)) {
+    close(epfd);
+    return NULL;
+  }
+  
+  atomic_store(&consumer->running, 1);
+  while(stopping == 0) {
+    n = epoll_wait(epfd, events, 2, -1);
+    if((n < 0) && (errno != EINTR)) {
+      fprintf(stderr, "Failed to wait for events: %s\n", strerror(errno));
+      break;
+    }
+    
+    /* Nonblocking, and it doesn't matter how many times we were woken */
+    if(read(consumer->wake_fd, &wakeups, sizeof(wakeups)) < 0) {
+      wakeups = 0;
+    }
+    
+    consumer_begin_batch(consumer);
+    ring__consume(ring);
+    consumer_end_batch(consumer);
+  }
+  atomic_store(&consumer->running, 0);
+  
+  close(epfd);
+  return NULL;
+}
 
+/**
+  start_consumer_threads: Starts one thread for each ringbuffer shard
+    except the first, which the main thread consumes.
+*/
+int start_consumer_threads() {
+  int i, retval;
+  
+  for(i = 1; i < bpf_info->num_rb_shards; i++) {
+    retval = pthread_create(&(bpf_info->consumers[i].thread), NULL,
+                            &consumer_thread_main, &(bpf_info->consumers[i]));
+    if(retval != 0) {
+      fprintf(stderr, "Failed to call pthread_create. Something is very wrong. Aborting.\n");
+      return -1;
+    }
+    num_consumer_threads++;
+  }
+  
   return 0;
 }
 
+/**
+  stop_consumer_threads: Wakes up each consumer thread so that
+    it sees that we're stopping, then waits for it to exit.
+*/
+void stop_consumer_threads() {
+  int i;
+  
+  stopping = 1;
+  for(i = 1; i <= num_consumer_threads; i++) {
+    wake_consumer(&(bpf_info->consumers[i]));
+  }
+  for(i = 1; i <= num_consumer_threads; i++) {
+    pthread_join(bpf_info->consumers[i].thread, NULL);
+  }
+}
+
+#endif
+
 /*******************************************************************************
 *                                  MAIN
 *******************************************************************************/
@@ -603,59 +1051,66 @@ int main(int argc, char **argv) {
     return 1;
   }
   
+  /* Every thread that we start from here on inherits this */
+  if(apply_housekeeping() != 0) {
+    free_opts();
+    return 1;
+  }
+  
   /* Open perf events and start gathering */
   bpf_info = calloc(1, sizeof(bpf_info_t));
   if(!bpf_info) {
     fprintf(stderr, "Failed to allocate memory! Aborting.\n");
     exit(1);
   }
-  if(program_events(pw_opts.pid) == -1) {
+  if(program_events() == -1) {
     retval = 1;
     goto cleanup;
   }
   
   /* Initialize the results struct. */
   init_results();
+  init_governor();
   
   /* Initialize the UI */
   if(pw_opts.csv) {
     print_csv_header(stdout);
   }
   
-  /* Start the ui thread, which will collect results
-     and, for each interval, render/print the UI. */
-  retval = start_ui_thread();
-  if(retval != 0) {
+  /* Set up the main loop before starting any threads, which inherit
+     its signal mask. */
+  if(init_main_loop() != 0) {
     retval = 1;
     goto cleanup;
   }
   
-  /* Poll for some new samples */
-#ifdef INSNPROF_LEGACY_PERF_BUFFER
-  int err;
-  while(stopping == 0) {
-    err = perf_buffer__poll(bpf_info->pb, 100);
-    if(err < 0) {
-      fprintf(stderr, "Failed to poll perf buffer: %d\n", err);
-      break;
-    }
+  /* Each interval, the main loop hands the results
+     to the output thread, which renders/prints the UI. */
+  if(start_output_thread() != 0) {
+    retval = 1;
+    goto cleanup;
   }
-#else
-  struct timespec time;
-  time.tv_sec = 0;
-  time.tv_nsec = 100000000;
-  while(stopping == 0) {
-    ring_buffer__consume(bpf_info->rb);
-    nanosleep(&time, NULL);
+  
+#ifndef INSNPROF_LEGACY_PERF_BUFFER
+  if(start_consumer_threads() != 0) {
+    stopping = 1;
+    retval = 1;
   }
 #endif
-
-  /* Send the stop signal to the profiling thread,
-     then wait for it to close successfully. */
-  pthread_kill(ui_thread_id, SIGTERM);
-  pthread_join(ui_thread_id, NULL);
+  
+  /* Poll for some new samples */
+  if(main_loop() != 0) {
+    retval = 1;
+  }
+  
+#ifndef INSNPROF_LEGACY_PERF_BUFFER
+  stop_consumer_threads();
+#endif
   
 cleanup:
+  stop_output_thread();
+  deinit_main_loop();
+  deinit_snapshots();
   deinit_bpf_info();
   deinit_results();
   free_opts();
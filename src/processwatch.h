@@ -5,6 +5,9 @@
 
 #include <errno.h>
 #include <inttypes.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #ifdef __x86_64__
 #include <Zydis/Zydis.h>
@@ -19,7 +22,9 @@
 #endif
 
 #include <linux/bpf.h>
+#include <linux/perf_event.h>
 #include <bpf/libbpf.h>
+#include "bpf/insn/insn.h"
 
 #ifdef __aarch64__
 #undef cs_bpf_insn
@@ -36,6 +41,51 @@ csh handle;
 #define CATEGORY_MAX_VALUE (AArch64_GRP_ENDING-1)
 #endif
 
+/**
+  decoded_insn_t
+  **
+  The parts of a decoded instruction that we keep: its mnemonic, and
+  the categories (and, on x86, the ISA extension) that it belongs to.
+**/
+#define MAX_INSN_GROUPS 8
+typedef struct {
+  int mnemonic;
+#ifdef __x86_64__
+  int category;
+  int extension;
+#elif __aarch64__
+  int num_groups;
+  int groups[MAX_INSN_GROUPS];
+#endif
+} decoded_insn_t;
+
+/**
+  insn_cache_entry_t
+  **
+  One entry in each consumer's cache of decoded instructions, keyed
+  on the raw instruction bytes. Most samples land on a handful of hot
+  instructions, so this saves us from decoding them again and again.
+**/
+#define INSN_CACHE_SIZE 4096
+#ifdef __x86_64__
+#define INSN_KEY_LEN 15
+#elif __aarch64__
+#define INSN_KEY_LEN 4
+#endif
+typedef struct {
+  uint64_t       key[2];
+  decoded_insn_t decoded;
+  uint8_t        valid;
+  uint8_t        success;
+} insn_cache_entry_t;
+
+/* Where relative --cgroup paths are looked up */
+#define CGROUP_ROOT "/sys/fs/cgroup"
+
+/* What each row of output represents */
+#define GROUP_BY_PID    0
+#define GROUP_BY_CGROUP 1
+
 /**
  pw_opts_t
  **
@@ -44,7 +94,35 @@ csh handle;
 struct pw_opts_t {
   char csv;
   unsigned int interval_time, num_intervals;
-  int pid;
+  
+  /* Only profile these processes, and those whose names start with these */
+  int *pids;
+  int num_pids;
+  char **comms;
+  int num_comms;
+  
+  /* Only sample while tasks in this cgroup are running */
+  char *cgroup_path;
+  
+  /* Only sample these CPUs, as a cpulist like "0-15,64-79" */
+  char *cpu_list;
+  
+  /* Only enable the events for this long in each interval, and
+     whether to start at a random offset into it */
+  unsigned int duty_on_ms;
+  char duty_random;
+  
+  /* Run our own threads on these CPUs, with these priorities */
+  char *housekeeping_cpus;
+  char sched_batch;
+  int nice;
+  
+  /* One of the GROUP_BY_ values */
+  char group_by;
+  
+  /* Count each thread separately */
+  char threads;
+  
   unsigned char show_mnemonics : 1;
   unsigned char show_extensions : 1;
   unsigned int sample_period;
@@ -59,8 +137,49 @@ struct pw_opts_t {
   char list;
   char debug;
   char all;
+  char aggregate;
+  int rb_shards;
+  unsigned int rb_size_mb;
+  
+  /* If either is set, the sampling period is retuned each interval */
+  double overhead_budget;
+  unsigned int sample_rate;
 };
 
+/**
+  consumer_t
+  **
+  Per-thread state for everything that ingests samples: one for each
+  ringbuffer shard, plus one that drains the aggregation map at the
+  end of each interval.
+  **
+  Each ringbuffer consumer counts samples into its own pair of
+  buffers, without locking. It writes to `buffers[gen & 1]`; at the
+  end of each interval, the UI thread increments `gen`, waits for the
+  consumer to acknowledge it, then merges the buffer that the consumer
+  was using before.
+**/
+struct interval_results;
+typedef struct {
+  int index;
+  pthread_t thread;
+#ifdef __aarch64__
+  csh handle;
+#endif
+  insn_cache_entry_t *insn_cache;
+
+  struct interval_results *buffers[2];
+  struct interval_results *interval;
+  unsigned int gen_seen;
+  unsigned int batch_samples;
+  atomic_uint  gen;
+  atomic_uint  acked;
+  atomic_int   running;
+  
+  /* An eventfd that wakes up the consumer's thread */
+  int wake_fd;
+} consumer_t;
+
 /**
   bpf_info_t
   **
@@ -77,55 +196,242 @@ typedef struct {
   struct bpf_link **links;
   size_t num_links;
   int nr_cpus;
+  
+  /* The perf event behind each link, or -1, and their current period */
+  int *perf_fds;
+  uint64_t sample_period;
   char pmu_name[32];
   
+  /* The event that every CPU opens, and how long attaching them all took */
+  struct perf_event_attr event_attr;
+  uint64_t attach_ns;
+  
+  /* Which CPUs were online when we last checked, one byte each */
+  char *cpu_online;
+  
+  /* Which CPUs -C asked for, one byte each, or NULL for all of them */
+  char *cpu_wanted;
+  int num_wanted_cpus;
+  
+  /* Tell us when processes exit or exec */
+  struct bpf_link *lifecycle_links[3];
+  
+  /* Whether the duty cycle has disabled every CPU's event */
+  char events_disabled;
+  
+  /* Counts how long our own threads run, in debug mode */
+  struct bpf_link *self_time_link;
+  
+  /* The cgroup to sample, or -1 for all */
+  int cgroup_fd;
+  
   struct ring_buffer *rb;
   struct perf_buffer *pb;
   
+  /* The total size of the ringbuffer (or of the per-CPU perf buffers) */
+  uint64_t rb_size;
+  
+  /* Ringbuffer shards, each of which is a ring in `rb` */
+  int num_rb_shards;
+  int *rb_shard_fds;
+  uint32_t rb_shard_size;
+  
+  /* The last consumer drains the aggregation map */
+  consumer_t *consumers;
+  int num_consumers;
+  
+  /* The BPF program's per-CPU stats as of the last interval, or NULL */
+  struct insn_stats *prev_stats;
+  
 } bpf_info_t;
 
+#define AGG_CONSUMER (&(bpf_info->consumers[bpf_info->num_consumers - 1]))
+
 
 /**
   process_t
   **
   Stores information about a process. We store pointers to
-  these in the `process_info` array: one for each
+  these in the `process_info` table: one for each
   process that we've seen.
 **/
-typedef struct {
+typedef struct process {
   int index;
+  uint32_t pid;
   char *name;
   uint32_t name_hash;
+  
+  /* The cgroup that the process was last seen in, if we're tracking them */
+  uint64_t cgroup_id;
+  
+  /* The stamp of the latest name record for it, so that an exit record
+     for an older process with the same PID and name can be ignored */
+  uint64_t gen;
+  
+  /* Set once the process has exited (or exec'd), with the interval
+     that it happened in. It's freed once that interval is output. */
+  char     exited;
+  uint64_t exit_interval;
+  struct process *next_exited;
+  
+  /* The process that used this PID before this one, if any */
+  struct process *prev;
 } process_t;
 
-#define MAX_PROCESSES 4194304
+/**
+  arena_chunk_t
+  **
+  A chunk of a bump allocator. `process_t` structs are never freed
+  individually, only recycled, so they're carved out of these and
+  freed all at once at teardown.
+**/
+#define ARENA_CHUNK_SIZE (64 * 1024)
+typedef struct arena_chunk {
+  struct arena_chunk *next;
+  size_t used, size;
+  char data[];
+} arena_chunk_t;
+
+/**
+  interned_str_t
+  **
+  A process name or cgroup path. `str` is what the rest of the code
+  sees; INTERNED_STR gets back to the header. Snapshots point at these
+  strings while they're being output, so once nothing else refers to
+  one, it waits on the graveyard until every snapshot up to
+  `dead_interval` has been released.
+**/
+typedef struct interned_str {
+  struct interned_str *next_dead;
+  uint64_t dead_interval;
+  uint32_t refs;
+  uint32_t hash;
+  char     str[];
+} interned_str_t;
+#define INTERNED_STR(s) ((interned_str_t *) ((s) - offsetof(interned_str_t, str)))
+
+/**
+  process_slot_t
+  **
+  An entry in the PID-keyed hash table. `latest` is the most recent
+  process to use this PID, and is NULL if the entry is empty.
+**/
+typedef struct {
+  uint32_t  pid;
+  process_t *latest;
+} process_slot_t;
 
 /**
   process_arr_t
   **
-  This is an array of lists of processes.
-  The first dimension is keyed on the PID of the process,
-  and the value is a pointer to an array of process_t pointers.
-  This array is NULL-terminated.
+  An open-addressing hash table keyed on the PID of the process,
+  whose entries point to a list of the processes that have used that PID,
+  most recent first. Its size is proportional to the number of PIDs seen.
+  **
+  Process names are interned in `names`, a hash set of strings that
+  count the processes using them, so PIDs that reuse the same name
+  share one copy.
+  **
+  Processes that have exited are kept on the `exited` list until their
+  last interval is output. Then they're unlinked, their process_t goes
+  on the `free_procs` list for reuse, and their name is released, so
+  the table only grows with the number of live processes.
   **
-  The header process_info.h initializes, grows, and accesses this array.
+  The header process_info.h initializes, grows, and accesses this table.
 **/
 typedef struct {
-  process_t **arr[MAX_PROCESSES];
-  int       max_pid;
+  process_slot_t *slots;
+  uint32_t       size;
+  uint32_t       count;
+  
+  char           **names;
+  uint32_t       names_size;
+  uint32_t       names_count;
+  
+  process_t      *exited;
+  process_t      *free_procs;
+  uint64_t       num_procs;
+  
+  arena_chunk_t  *arena;
+  interned_str_t *graveyard;
 } process_arr_t;
 
 
+/**
+  cgroup_t
+  **
+  An entry in the cache of cgroup paths, an open-addressing hash table
+  keyed on the cgroup's ID. An entry with a NULL path is empty.
+**/
+typedef struct {
+  uint64_t id;
+  char     *path;
+} cgroup_t;
+
+typedef struct {
+  cgroup_t *entries;
+  uint32_t size;
+  uint32_t count;
+  
+  /* How many entries were left after the last pruning */
+  uint32_t live_count;
+  
+  /* The cgroup2 mount, which IDs are resolved relative to */
+  int      root_fd;
+} cgroup_arr_t;
+
+/**
+  pid_index_entry_t
+  **
+  An entry in the open-addressing hash table that maps a PID to its
+  slot in an interval's per-process arrays. An entry is only valid if
+  its `gen` matches the interval's, so the table is cleared each
+  interval just by incrementing the interval's generation.
+**/
+typedef struct {
+  uint32_t pid;
+  uint32_t gen;
+  int      slot;
+} pid_index_entry_t;
+
+/**
+  proc_counts_t
+  **
+  One process's counts for one interval. There are only a few hundred
+  categories and extensions, so those are dense arrays. Most processes
+  only use a few of the thousands of mnemonics, so those are stored
+  in a small open-addressing table, keyed on the mnemonic, that grows
+  as needed. An entry with a zero count is empty.
+**/
+typedef struct {
+  uint32_t mnemonic;
+  uint64_t count;
+} insn_count_entry_t;
+
+typedef struct __attribute__((aligned(64))) {
+  uint64_t  num_samples;
+  uint64_t  num_failed;
+  insn_count_entry_t *insn_count;
+  uint32_t  insn_count_size;
+  uint32_t  insn_count_used;
+  
+  uint64_t  cat_count[CATEGORY_MAX_VALUE+1];
+#ifdef __x86_64__
+  uint64_t  ext_count[EXTENSION_MAX_VALUE+1];
+#endif
+} proc_counts_t;
+
 /**
   interval_results_t
   **
   Stores all profiling information. Most of this is cleared
   each interval. We categorize each instruction that we see,
-  and each array has one value per instruction category.
-  We also have per-process arrays, which dynamically grow
-  as we see more processes. Gets updated by `results.h`.
+  and each array has one count per instruction category.
+  Percentages are computed from these counts when displayed.
+  We also have per-process counter blocks, which dynamically
+  grow as we see more processes. Gets updated by `results.h`.
 **/
-typedef struct {
+typedef struct interval_results {
   /*
      TOTALS
      insn = instruction (mnemonic)
@@ -135,47 +441,51 @@ typedef struct {
 
   uint64_t  cat_count[CATEGORY_MAX_VALUE+1];
   uint64_t  insn_count[MNEMONIC_MAX_VALUE+1];
-  double    cat_percent[CATEGORY_MAX_VALUE+1];
-  double    insn_percent[MNEMONIC_MAX_VALUE+1];
-  double    failed_percent;
   
-  /*
-     PER PROCESS
-     insn = instruction (mnemonic)
-     cat = category
-     ext = extension
-     proc = process
-  */
-  uint64_t  *proc_cat_count[CATEGORY_MAX_VALUE+1];
-  uint64_t  *proc_insn_count[MNEMONIC_MAX_VALUE+1];
-  double    *proc_cat_percent[CATEGORY_MAX_VALUE+1];
-  double    *proc_insn_percent[MNEMONIC_MAX_VALUE+1];
-  double    *proc_percent;
-  double    *proc_failed_percent;
+  /* PER PROCESS: one block per slot, reused across intervals */
+  proc_counts_t **procs;
   
   /* Only for x86, also include ISA extensions */
   #ifdef __x86_64__
   uint64_t  ext_count[EXTENSION_MAX_VALUE+1];
-  double    ext_percent[EXTENSION_MAX_VALUE+1];
-  uint64_t  *proc_ext_count[EXTENSION_MAX_VALUE+1];
-  double    *proc_ext_percent[EXTENSION_MAX_VALUE+1];
   #endif
   
   /* Per-interval counts */
   uint64_t  num_samples;
   uint64_t  num_failed;
   
-  /* Per-interval per-process counts */
-  uint64_t  *proc_num_samples;
-  uint64_t  *proc_num_failed;
-
+  /* Decode cache stats, and the time spent decoding on a miss */
+  uint64_t  cache_hits;
+  uint64_t  cache_misses;
+  uint64_t  decode_ns;
+  
   /* Keep track of PIDs */
   int       proc_arr_size;
   int       pid_ctr;
   uint32_t  *pids;
   
-  /* Ringbuffer stats */
+  /* Maps PIDs to their index in `procs` */
+  pid_index_entry_t *pid_index;
+  uint32_t  pid_index_size;
+  uint32_t  pid_index_gen;
+  
+  /* The sampling period in effect during this interval */
+  uint64_t  sample_period;
+  
+  /* The number of CPUs with an event attached, at the end of the interval */
+  int       num_cpus_attached;
+  
+  /* How much to scale sample counts up by, to make up for
+     the time that the duty cycle disabled the events for */
+  double    duty_scale;
+  
+  /* Samples that the BPF program couldn't record, overall and per-CPU */
+  struct insn_stats stats;
+  struct insn_stats *cpu_stats;
+  
+  /* Ringbuffer stats. The overall value is the fullest shard. */
   double ringbuf_used;
+  double *shard_ringbuf_used;
 } interval_results_t;
 
 
@@ -194,19 +504,48 @@ typedef struct {
   double   failed_percent;
   
   process_arr_t process_info;
+  cgroup_arr_t  cgroup_info;
   
 #ifdef __x86_64__
   ZydisDecoder            decoder;
   ZydisFormatter          formatter;
-  ZydisDecodedInstruction decoded_insn;
 #endif
   
   /* The interval */
   interval_results_t *interval;
 } results_t;
 
+/**
+  snapshot_t
+  **
+  A finished interval, handed from the UI thread to the output thread.
+  It owns its interval_results_t, and has each slot's process name,
+  so the output thread never needs the results lock. The names
+  are interned, and live until the process table is freed.
+  **
+  When grouping by cgroup, each slot is a cgroup instead: its name is
+  the cgroup's path, and its PID is the number of processes in it.
+**/
+typedef struct snapshot {
+  interval_results_t *interval;
+  uint64_t interval_num;
+  
+  /* Intervals that were dropped because output fell behind, so far */
+  uint64_t dropped;
+  
+  /* Processes in the process table, live or waiting to be freed */
+  uint64_t num_procs;
+  
+  char     **proc_names;
+  int      proc_names_size;
+  
+  /* Scratch space for grouping by cgroup */
+  uint64_t *group_ids;
+} snapshot_t;
+
 /* Need these globals outside of insnprof.c */
 extern results_t *results;
+extern snapshot_t *output_snapshot;
 extern bpf_info_t *bpf_info;
 extern pthread_rwlock_t results_lock;
 extern struct pw_opts_t pw_opts;
@@ -216,6 +555,9 @@ extern struct pw_opts_t pw_opts;
 #include "kerninfo.h"
 #include "setup_bpf.h"
 #include "process_info.h"
+#include "governor.h"
+#include "housekeeping.h"
+#include "duty_cycle.h"
 
 /* The UI */
 #include "ui/utils.h"
@@ -4,205 +4,900 @@
 #pragma once
 
 #include <inttypes.h>
+#include <unistd.h>
+#include <bpf/bpf.h>
 #include "process_info.h"
 #include "bpf/insn/insn.h"
+#include "bpf/insn/insn.skel.h"
 
-/* Only the function signature differs between the perf_buffer and ringbuffer versions */
-#ifdef INSNPROF_LEGACY_PERF_BUFFER
-static void handle_sample(void *ctx, int cpu, void *data, unsigned int data_sz) {
-#else
-static int handle_sample(void *ctx, void *data, size_t data_sz) {
-#endif
-
-  struct insn_info *insn_info;
-  int category, mnemonic, success;
-  int interval_index;
+/**
+  decode_insn
+  **
+  Decodes the raw instruction bytes in `insn`, and stores the parts
+  that we keep in `decoded`. Returns 1 if successful, 0 otherwise.
+  Each consumer thread passes in its own state.
+**/
+static int decode_insn(consumer_t *consumer, unsigned char *insn, decoded_insn_t *decoded) {
 #ifdef __x86_64__
-  int extension;
-#endif
-  uint32_t hash;
-
-  insn_info = data;
-  success = 0;
+  ZyanStatus status;
+  ZydisDecodedInstruction decoded_insn;
   
-  category = -1;
-  mnemonic = -1;
-#ifdef __x86_64__
-  extension = -1;
+  status = ZydisDecoderDecodeInstruction(&results->decoder,
+                                         ZYAN_NULL,
+                                         insn, 15,
+                                         &decoded_insn);
+  if(!ZYAN_SUCCESS(status)) {
+    return 0;
+  }
+  decoded->mnemonic = decoded_insn.mnemonic;
+  decoded->category = decoded_insn.meta.category;
+  decoded->extension = decoded_insn.meta.isa_ext;
+  
+  return 1;
+#elif __aarch64__
+  int count, i;
+  cs_insn *cs_insn;
+  
+  count = cs_disasm(consumer->handle, insn, 4, 0, 0, &cs_insn);
+  if(!count) {
+    return 0;
+  }
+  if(!cs_insn[0].detail) {
+    cs_free(cs_insn, count);
+    return 0;
+  }
+  decoded->mnemonic = cs_insn[0].id;
+  
+  // Capstone (LLVM) puts some instructions in 0, 1 or more groups
+  decoded->num_groups = 0;
+  for(i = 0; (i < cs_insn[0].detail->groups_count) && (i < MAX_INSN_GROUPS); i++) {
+    decoded->groups[decoded->num_groups++] = cs_insn[0].detail->groups[i];
+  }
+  cs_free(cs_insn, count);
+  
+  return 1;
 #endif
+}
 
-  #ifdef __x86_64__
-    ZyanStatus status;
-    status = ZydisDecoderDecodeInstruction(&results->decoder,
-                                           ZYAN_NULL,
-                                           insn_info->insn, 15,
-                                           &results->decoded_insn);
-    if(ZYAN_SUCCESS(status)) {
-      success = 1;
-      mnemonic = results->decoded_insn.mnemonic;
-      category = results->decoded_insn.meta.category;
-#ifdef __x86_64__
-      extension = results->decoded_insn.meta.isa_ext;
-#endif
-    }
-  #elif __aarch64__
-    int count;
-    cs_insn *insn;
-    count = cs_disasm(handle, insn_info->insn, 4, 0, 0, &insn);
-    if(count && insn[0].detail) {
-      success = 1;
-      mnemonic = insn[0].id;
-    }
-  #endif
+/**
+  decode_insn_cached
+  **
+  Looks up the raw instruction bytes in the consumer's decode cache,
+  and only decodes them on a miss. The cache is direct-mapped, so a
+  miss replaces whatever was in that slot. Failures are cached, too.
+  Hits and misses are counted in `interval`, and in debug mode, the
+  time spent decoding.
+**/
+static int decode_insn_cached(consumer_t *consumer, interval_results_t *interval,
+                              unsigned char *insn, decoded_insn_t *decoded) {
+  insn_cache_entry_t *entry;
+  uint64_t key[2], hash;
+  struct timespec start, end;
   
-  if(pthread_rwlock_wrlock(&results_lock) != 0) {
-    fprintf(stderr, "Failed to grab write lock! Aborting.\n");
-    exit(1);
+  key[0] = 0;
+  key[1] = 0;
+  memcpy(key, insn, INSN_KEY_LEN);
+  hash = (key[0] * 0x9E3779B97F4A7C15ULL) ^ (key[1] * 0xC2B2AE3D27D4EB4FULL);
+  entry = &(consumer->insn_cache[(hash >> 32) & (INSN_CACHE_SIZE - 1)]);
+  
+  if(entry->valid && (entry->key[0] == key[0]) && (entry->key[1] == key[1])) {
+    interval->cache_hits++;
+    *decoded = entry->decoded;
+    return entry->success;
+  }
+  
+  /* Decode time is only shown in debug mode, so only pay to time it then */
+  if(pw_opts.debug) {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    entry->success = decode_insn(consumer, insn, &(entry->decoded));
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    interval->decode_ns += ((end.tv_sec - start.tv_sec) * 1000000000ULL) +
+                           end.tv_nsec - start.tv_nsec;
+  } else {
+    entry->success = decode_insn(consumer, insn, &(entry->decoded));
   }
+  interval->cache_misses++;
   
-  hash = djb2(insn_info->name);
-  update_process_info(insn_info->pid, insn_info->name, hash);
+  entry->key[0] = key[0];
+  entry->key[1] = key[1];
+  entry->valid = 1;
+  *decoded = entry->decoded;
+  return entry->success;
+}
+
+/**
+  record_insn
+  **
+  Adds `count` samples of the same instruction, from the same process,
+  to `interval`. `decoded` is NULL if the instruction failed to decode.
+  Only the thread that owns `interval` may call this.
+**/
+static void record_insn(interval_results_t *interval, uint32_t pid,
+                        decoded_insn_t *decoded, uint64_t count) {
+  proc_counts_t *proc;
+#ifdef __aarch64__
+  int i, category;
+#endif
 
-  /* Store this result in the per-process array */
-  interval_index = get_interval_proc_arr_index(insn_info->pid);
+  /* Store this result in the process's counter block */
+  proc = interval->procs[get_interval_proc_arr_index(interval, pid)];
 
-  if(success) {
-    results->interval->insn_count[mnemonic]++;
-    results->interval->proc_insn_count[mnemonic][interval_index]++;
+  if(decoded) {
+    interval->insn_count[decoded->mnemonic] += count;
+    add_proc_insn_count(proc, decoded->mnemonic, count);
 
 #ifdef __x86_64__
-    results->interval->cat_count[results->decoded_insn.meta.category]++;
-    results->interval->proc_cat_count[category][interval_index]++;
-    results->interval->ext_count[results->decoded_insn.meta.isa_ext]++;
-    results->interval->proc_ext_count[extension][interval_index]++;
+    interval->cat_count[decoded->category] += count;
+    proc->cat_count[decoded->category] += count;
+    interval->ext_count[decoded->extension] += count;
+    proc->ext_count[decoded->extension] += count;
 #elif __aarch64__
-    int i;
-    // Capstone (LLVM) puts some instructions in 0, 1 or more groups
-    for (i = 0; i < insn[0].detail->groups_count; i++) {
-      category = insn[0].detail->groups[i];
-      results->interval->cat_count[category]++;
-      results->interval->proc_cat_count[category][interval_index]++;
+    for(i = 0; i < decoded->num_groups; i++) {
+      category = decoded->groups[i];
+      interval->cat_count[category] += count;
+      proc->cat_count[category] += count;
     }
-    cs_free(insn, count);
 #endif
     
   } else {
-    results->interval->num_failed++;
-    results->interval->proc_num_failed[interval_index]++;
-    results->num_failed++;
+    interval->num_failed += count;
+    proc->num_failed += count;
   }
 
-  results->interval->num_samples++;
-  results->interval->proc_num_samples[interval_index]++;
-  results->interval->pids[interval_index] = insn_info->pid;
-  results->num_samples++;
+  interval->num_samples += count;
+  proc->num_samples += count;
+}
 
+/**
+  handle_comm: Records a process's name, or that it has exited.
+**/
+static void handle_comm(struct comm_info *comm_info) {
+  char thread_name[TASK_COMM_LEN * 2];
+  uint32_t key;
+  char *name;
+  
+  key = comm_info->pid;
+  name = comm_info->name;
+  if(pw_opts.threads) {
+    /* Each thread is its own row, named after its process and itself */
+    key = comm_info->tid;
+    if(strncmp(comm_info->name, comm_info->thread_name, TASK_COMM_LEN) != 0) {
+      snprintf(thread_name, sizeof(thread_name), "%.*s/%.*s",
+               TASK_COMM_LEN, comm_info->name, TASK_COMM_LEN, comm_info->thread_name);
+      name = thread_name;
+    }
+  }
+  
+  if(pthread_rwlock_wrlock(&results_lock) != 0) {
+    fprintf(stderr, "Failed to grab write lock! Aborting.\n");
+    exit(1);
+  }
+  if(comm_info->type == RECORD_EXIT) {
+    mark_process_exited(key, name, djb2(name), comm_info->gen);
+  } else {
+    update_process_info(key, name, djb2(name), comm_info->cgroup_id, comm_info->gen);
+  }
   if(pthread_rwlock_unlock(&results_lock) != 0) {
     fprintf(stderr, "Failed to unlock the lock! Aborting.\n");
     exit(1);
   }
+}
+
+/**
+  consumer_batch_done: ring__consume keeps going for as long as BPF keeps
+  producing, so under sustained load a batch would never end, and the
+  interval could never be swapped. Returning this from the callback stops
+  the batch after the current sample, once the buffers have been swapped
+  or the batch is long enough. Whatever's left in the ring is still
+  readable, so epoll returns right away for the next batch.
+**/
+#define CONSUMER_BATCH_DONE (-ECANCELED)
+#define CONSUMER_BATCH_MAX 65536
+
+static int consumer_batch_done(consumer_t *consumer) {
+  if(++(consumer->batch_samples) >= CONSUMER_BATCH_MAX) {
+    return 1;
+  }
+  return atomic_load_explicit(&consumer->gen, memory_order_relaxed) != consumer->gen_seen;
+}
+
+/* Only the function signature differs between the perf_buffer and ringbuffer versions */
+#ifdef INSNPROF_LEGACY_PERF_BUFFER
+static void handle_sample(void *ctx, int cpu, void *data, unsigned int data_sz) {
+#else
+static int handle_sample(void *ctx, void *data, size_t data_sz) {
+#endif
+
+  struct insn_info *insn_info;
+  consumer_t *consumer;
+  decoded_insn_t decoded;
+  int success;
+
+  insn_info = data;
+  consumer = ctx;
+  
+  /* Process names arrive separately from, and before, their samples,
+     and exits arrive after them */
+  if((insn_info->type == RECORD_COMM) || (insn_info->type == RECORD_EXIT)) {
+    handle_comm(data);
+#ifdef INSNPROF_LEGACY_PERF_BUFFER
+    return;
+#else
+    return 0;
+#endif
+  }
+  
+  /* The consumer's own buffer, so no locking */
+  success = decode_insn_cached(consumer, consumer->interval, insn_info->insn, &decoded);
+  record_insn(consumer->interval, pw_opts.threads ? insn_info->tid : insn_info->pid,
+              success ? &decoded : NULL, 1);
   
 #ifndef INSNPROF_LEGACY_PERF_BUFFER
+  if(consumer_batch_done(consumer)) {
+    return CONSUMER_BATCH_DONE;
+  }
   return 0;
 #endif
 }
 
+#ifndef INSNPROF_LEGACY_PERF_BUFFER
+
+/**
+  drain_insn_agg
+  **
+  Reads and deletes every entry in the BPF aggregation map, summing
+  the per-CPU counts and decoding each unique instruction only once.
+  Called once per interval by the UI thread, which owns results->interval.
+**/
+#define AGG_BATCH_SIZE 4096
+static int drain_insn_agg() {
+  struct insn_agg_key *keys;
+  struct bpf_map_batch_opts opts = {0};
+  uint64_t *values, count;
+  uint32_t batch, num_keys;
+  decoded_insn_t decoded;
+  int fd, err, i, cpu, success, first, done, retval;
+  
+  opts.sz = sizeof(struct bpf_map_batch_opts);
+  fd = bpf_map__fd(bpf_info->obj->maps.agg);
+  
+  /* Per-CPU maps return one value per possible CPU */
+  keys = calloc(AGG_BATCH_SIZE, sizeof(struct insn_agg_key));
+  values = calloc(AGG_BATCH_SIZE * bpf_info->nr_cpus, sizeof(uint64_t));
+  if(!keys || !values) {
+    fprintf(stderr, "Failed to allocate memory! Aborting.\n");
+    exit(1);
+  }
+  
+  retval = 0;
+  first = 1;
+  done = 0;
+  while(!done) {
+    num_keys = AGG_BATCH_SIZE;
+    err = bpf_map_lookup_and_delete_batch(fd, first ? NULL : &batch, &batch,
+                                          keys, values, &num_keys, &opts);
+    if(err < 0) {
+      /* ENOENT means that this was the last batch */
+      if(errno != ENOENT) {
+        fprintf(stderr, "Failed to read the aggregation map: %s\n", strerror(errno));
+        retval = -1;
+        break;
+      }
+      done = 1;
+    }
+    first = 0;
+    
+    for(i = 0; i < num_keys; i++) {
+      count = 0;
+      for(cpu = 0; cpu < bpf_info->nr_cpus; cpu++) {
+        count += values[(i * bpf_info->nr_cpus) + cpu];
+      }
+      if(!count) continue;
+      
+      success = decode_insn_cached(AGG_CONSUMER, results->interval, keys[i].insn, &decoded);
+      record_insn(results->interval, keys[i].pid, success ? &decoded : NULL, count);
+    }
+  }
+  
+  free(keys);
+  free(values);
+  return retval;
+}
+
+#endif
+
+/**
+  alloc_interval_results: Allocates an empty set of interval counters.
+**/
+static interval_results_t *alloc_interval_results() {
+  interval_results_t *interval;
+  
+  interval = calloc(1, sizeof(interval_results_t));
+  if(!interval) {
+    fprintf(stderr, "Failed to allocate memory! Aborting.\n");
+    exit(1);
+  }
+  
+  /* Grow the per-process arrays to the first size class */
+  grow_interval_proc_arrs(interval);
+  grow_pid_index(interval);
+  
+  return interval;
+}
+
+static void free_interval_results(interval_results_t *interval) {
+  int i;
+  
+  if(!interval) {
+    return;
+  }
+  
+  free(interval->shard_ringbuf_used);
+  free(interval->cpu_stats);
+  free(interval->pids);
+  free(interval->pid_index);
+  for(i = 0; i < interval->proc_arr_size; i++) {
+    free_proc_counts(interval->procs[i]);
+  }
+  free(interval->procs);
+  free(interval);
+}
+
+/**
+  alloc_results_interval: Allocates an interval that can be results->interval,
+  which also stores ringbuffer and per-CPU stats.
+**/
+static interval_results_t *alloc_results_interval() {
+  interval_results_t *interval;
+  
+  interval = alloc_interval_results();
+  interval->shard_ringbuf_used = calloc(bpf_info->num_rb_shards, sizeof(double));
+  interval->cpu_stats = calloc(bpf_info->nr_cpus, sizeof(struct insn_stats));
+  if(!interval->shard_ringbuf_used || !interval->cpu_stats) {
+    fprintf(stderr, "Failed to allocate memory! Aborting.\n");
+    exit(1);
+  }
+  
+  return interval;
+}
+
 static void init_results() {
   results = calloc(1, sizeof(results_t));
   if(!results) {
     fprintf(stderr, "Failed to allocate memory! Aborting.\n");
     exit(1);
   }
-  results->interval = calloc(1, sizeof(interval_results_t));
+  grow_process_info();
+  results->interval = alloc_results_interval();
   
 #ifdef __x86_64__
   ZydisDecoderInit(&results->decoder, ZYDIS_MACHINE_MODE_LONG_64, ZYDIS_STACK_WIDTH_64);
   ZydisFormatterInit(&results->formatter, ZYDIS_FORMATTER_STYLE_INTEL);
+  /* Minimal mode isn't usable: it skips filling in the category and ISA
+     extension. ZydisDecoderDecodeInstruction already skips the operands. */
 #endif
-  
-  /* Grow the per-process arrays to the first size class */
-  grow_interval_proc_arrs();
 }
 
-static int clear_interval_results() {
+/**
+  clear_interval_counts: Zeroes all of the counters in `interval`.
+**/
+static void clear_interval_counts(interval_results_t *interval) {
   int i;
   
-  memset(results->interval->proc_num_samples, 0, results->interval->proc_arr_size * sizeof(uint64_t));
-  memset(results->interval->proc_num_failed, 0, results->interval->proc_arr_size * sizeof(uint64_t));
-  memset(results->interval->pids, 0, results->interval->proc_arr_size * sizeof(uint32_t));
-  results->interval->num_samples = 0;
-  results->interval->num_failed = 0;
-  
-  for(i = 0; i <= CATEGORY_MAX_VALUE; i++) {
-    memset(results->interval->proc_cat_count[i], 0, results->interval->proc_arr_size * sizeof(uint64_t));
-  }
-  for(i = 0; i <= MNEMONIC_MAX_VALUE; i++) {
-    memset(results->interval->proc_insn_count[i], 0, results->interval->proc_arr_size * sizeof(uint64_t));
+  /* Only the blocks that were used this interval */
+  for(i = 0; i < interval->pid_ctr; i++) {
+    clear_proc_counts(interval->procs[i]);
   }
+  memset(interval->pids, 0, interval->pid_ctr * sizeof(uint32_t));
+  interval->num_samples = 0;
+  interval->num_failed = 0;
+  interval->cache_hits = 0;
+  interval->cache_misses = 0;
+  interval->decode_ns = 0;
   
   /* Per-category or per-instruction arrays */
-  memset(results->interval->cat_count, 0, (CATEGORY_MAX_VALUE + 1) * sizeof(uint64_t));
-  memset(results->interval->insn_count, 0, (MNEMONIC_MAX_VALUE + 1) * sizeof(uint64_t));
+  memset(interval->cat_count, 0, (CATEGORY_MAX_VALUE + 1) * sizeof(uint64_t));
+  memset(interval->insn_count, 0, (MNEMONIC_MAX_VALUE + 1) * sizeof(uint64_t));
+  
+#ifdef __x86_64__
+  memset(interval->ext_count, 0, (EXTENSION_MAX_VALUE + 1) * sizeof(uint64_t));
+#endif
+  
+  memset(&(interval->stats), 0, sizeof(struct insn_stats));
+  if(interval->cpu_stats) {
+    memset(interval->cpu_stats, 0, bpf_info->nr_cpus * sizeof(struct insn_stats));
+  }
+  
+  interval->pid_ctr = 0;
+  clear_pid_index(interval);
+}
+
+/**
+  merge_interval_results: Adds the counts in `src` to `dst`, matching
+  up processes by PID.
+**/
+static void merge_interval_results(interval_results_t *dst, interval_results_t *src) {
+  int i, n;
   
+  for(i = 0; i < src->pid_ctr; i++) {
+    merge_proc_counts(dst->procs[get_interval_proc_arr_index(dst, src->pids[i])],
+                      src->procs[i]);
+  }
+  
+  for(n = 0; n <= CATEGORY_MAX_VALUE; n++) {
+    dst->cat_count[n] += src->cat_count[n];
+  }
+  for(n = 0; n <= MNEMONIC_MAX_VALUE; n++) {
+    dst->insn_count[n] += src->insn_count[n];
+  }
 #ifdef __x86_64__
-  for(i = 0; i <= EXTENSION_MAX_VALUE; i++) {
-    memset(results->interval->proc_ext_count[i], 0, results->interval->proc_arr_size * sizeof(uint64_t));
+  for(n = 0; n <= EXTENSION_MAX_VALUE; n++) {
+    dst->ext_count[n] += src->ext_count[n];
   }
-  memset(results->interval->ext_count, 0, (EXTENSION_MAX_VALUE + 1) * sizeof(uint64_t));
 #endif
+  dst->num_samples += src->num_samples;
+  dst->num_failed += src->num_failed;
+  dst->cache_hits += src->cache_hits;
+  dst->cache_misses += src->cache_misses;
+  dst->decode_ns += src->decode_ns;
+}
+
+/**
+  consumer_begin_batch, consumer_end_batch: Called by each ringbuffer
+  consumer around each batch of samples that it reads. The buffer that
+  it writes to can only change between batches, so there's no need for
+  any locking per sample, only a relaxed check for the end of a batch.
+**/
+static void consumer_begin_batch(consumer_t *consumer) {
+  consumer->gen_seen = atomic_load_explicit(&consumer->gen, memory_order_acquire);
+  consumer->interval = consumer->buffers[consumer->gen_seen & 1];
+  consumer->batch_samples = 0;
+}
+
+static void consumer_end_batch(consumer_t *consumer) {
+  atomic_store_explicit(&consumer->acked, consumer->gen_seen, memory_order_release);
+}
+
+/**
+  wake_consumer: Wakes up a consumer's thread, so that it
+  reads its ringbuffer and finishes a batch.
+**/
+static void wake_consumer(consumer_t *consumer) {
+  uint64_t one = 1;
   
-  results->interval->pid_ctr = 0;
-  results->interval_num++;
+  if(write(consumer->wake_fd, &one, sizeof(one)) != sizeof(one)) {
+    /* The counter is already nonzero, so it's awake anyway */
+    return;
+  }
+}
+
+/**
+  swap_consumer_buffers: Points each ringbuffer consumer at its other
+  buffer, then waits until they've all finished their current batch,
+  which they end early once they see the swap. `self` is the consumer
+  that the calling thread runs, if any, which is between batches. Must
+  be called without the write lock, which consumers take to record
+  process names.
+**/
+static void swap_consumer_buffers(consumer_t *self) {
+  consumer_t *consumer;
+  unsigned int gen;
+  struct timespec time;
+  int i;
   
-  return 0;
+  /* Swap and wake them all first, so that they finish in parallel */
+  for(i = 0; i < bpf_info->num_rb_shards; i++) {
+    consumer = &(bpf_info->consumers[i]);
+    gen = atomic_fetch_add(&consumer->gen, 1) + 1;
+    if(consumer == self) {
+      atomic_store_explicit(&consumer->acked, gen, memory_order_release);
+      continue;
+    }
+    
+    /* An idle consumer would otherwise sleep until more samples came */
+    wake_consumer(consumer);
+  }
+  
+  time.tv_sec = 0;
+  time.tv_nsec = 1000000;
+  for(i = 0; i < bpf_info->num_rb_shards; i++) {
+    consumer = &(bpf_info->consumers[i]);
+    gen = atomic_load(&consumer->gen);
+    while(atomic_load(&consumer->running) &&
+          (atomic_load_explicit(&consumer->acked, memory_order_acquire) != gen)) {
+      nanosleep(&time, NULL);
+    }
+  }
 }
 
-static void deinit_results() {
+/**
+  merge_consumer_results: After swap_consumer_buffers, merges the buffers
+  that the consumers were using into results->interval, then clears them.
+**/
+static void merge_consumer_results() {
+  consumer_t *consumer;
+  interval_results_t *old;
   int i;
-  process_t **proc_arr;
   
+  for(i = 0; i < bpf_info->num_rb_shards; i++) {
+    consumer = &(bpf_info->consumers[i]);
+    old = consumer->buffers[(atomic_load(&consumer->gen) + 1) & 1];
+    merge_interval_results(results->interval, old);
+    clear_interval_counts(old);
+  }
+}
+
+static void deinit_results() {
   if(!results) {
     return;
   }
+  
+  deinit_process_info();
+  free_interval_results(results->interval);
+  free(results);
+}
+
+/*******************************************************************************
+*                                  SNAPSHOTS
+*******************************************************************************/
+
+/* The output thread's mailbox holds at most one snapshot. If the UI
+   thread finishes another interval before the output thread takes it,
+   the older one is dropped. One spare is kept for the next interval. */
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  snapshot_cond = PTHREAD_COND_INITIALIZER;
+static snapshot_t *pending_snapshot = NULL;
+static snapshot_t *spare_snapshot = NULL;
+static snapshot_t *outputting_snapshot = NULL;
+static uint64_t   dropped_snapshots = 0;
+static int        snapshots_closed = 0;
+
+static snapshot_t *alloc_snapshot() {
+  snapshot_t *snapshot;
+  
+  snapshot = calloc(1, sizeof(snapshot_t));
+  if(!snapshot) {
+    fprintf(stderr, "Failed to allocate memory! Aborting.\n");
+    exit(1);
+  }
+  snapshot->interval = alloc_results_interval();
+  
+  return snapshot;
+}
+
+static void free_snapshot(snapshot_t *snapshot) {
+  if(!snapshot) return;
+  free_interval_results(snapshot->interval);
+  free(snapshot->proc_names);
+  free(snapshot->group_ids);
+  free(snapshot);
+}
 
-  for(i = 0; i <= results->process_info.max_pid; i++) {
-    proc_arr = results->process_info.arr[i];
-    if(!proc_arr) continue;
-    while(*proc_arr) {
-      free((*proc_arr)->name);
-      free(*proc_arr);
-      proc_arr++;
+/**
+  group_snapshot_by_cgroup: Folds the snapshot's per-process counts into
+  one slot per cgroup, in place. Each slot's PID becomes the number of
+  processes in that cgroup, and its name becomes the cgroup's path.
+  There are usually only a handful of cgroups, so they're searched linearly.
+  Cgroups that aren't in the cache yet are left without a name, for
+  resolve_snapshot_cgroups.
+**/
+static void group_snapshot_by_cgroup(snapshot_t *snapshot) {
+  interval_results_t *interval;
+  proc_counts_t *tmp;
+  process_t *process;
+  uint64_t id;
+  int i, g, num_groups;
+  
+  interval = snapshot->interval;
+  num_groups = 0;
+  for(i = 0; i < interval->pid_ctr; i++) {
+    process = get_interval_process_info(interval->pids[i]);
+    id = process ? process->cgroup_id : 0;
+    
+    for(g = 0; g < num_groups; g++) {
+      if(snapshot->group_ids[g] == id) break;
+    }
+    
+    if(g < num_groups) {
+      /* Fold this process into its cgroup's slot */
+      merge_proc_counts(interval->procs[g], interval->procs[i]);
+      clear_proc_counts(interval->procs[i]);
+      interval->pids[g]++;
+    } else {
+      /* Start a new slot. The block it displaces has already been folded. */
+      tmp = interval->procs[num_groups];
+      interval->procs[num_groups] = interval->procs[i];
+      interval->procs[i] = tmp;
+      snapshot->group_ids[num_groups] = id;
+      snapshot->proc_names[num_groups] = find_cgroup_path(id);
+      interval->pids[num_groups] = 1;
+      num_groups++;
     }
-    free(results->process_info.arr[i]);
   }
   
-  free(results->interval->pids);
-  free(results->interval->proc_num_samples);
-  free(results->interval->proc_num_failed);
-  free(results->interval->proc_percent);
-  free(results->interval->proc_failed_percent);
-  for(i = 0; i <= CATEGORY_MAX_VALUE; i++) {
-    free(results->interval->proc_cat_count[i]);
-    free(results->interval->proc_cat_percent[i]);
+  /* The PID index no longer matches the slots */
+  interval->pid_ctr = num_groups;
+  clear_pid_index(interval);
+}
+
+/**
+  free_unused_strs: The snapshots point at names and cgroup paths, so
+  the ones that were buried can only be freed once neither the snapshot
+  that's being output nor the one that's waiting could point at them.
+  `current` is the one that's being taken.
+**/
+static void free_unused_strs(uint64_t current) {
+  uint64_t oldest;
+  
+  oldest = current;
+  pthread_mutex_lock(&snapshot_lock);
+  if(pending_snapshot && (pending_snapshot->interval_num < oldest)) {
+    oldest = pending_snapshot->interval_num;
   }
-  for(i = 0; i <= MNEMONIC_MAX_VALUE; i++) {
-    free(results->interval->proc_insn_count[i]);
-    free(results->interval->proc_insn_percent[i]);
+  if(outputting_snapshot && (outputting_snapshot->interval_num < oldest)) {
+    oldest = outputting_snapshot->interval_num;
   }
-#ifdef __x86_64__
-  for(i = 0; i <= EXTENSION_MAX_VALUE; i++) {
-    free(results->interval->proc_ext_count[i]);
-    free(results->interval->proc_ext_percent[i]);
+  pthread_mutex_unlock(&snapshot_lock);
+  
+  free_dead_strs(oldest);
+}
+
+/**
+  take_snapshot: Ends the interval. Swaps results->interval for an empty
+  one, and returns the finished one in a snapshot with its process names filled in. Must be called with the
+  write lock held. Never waits on the output thread: if there's no spare,
+  it reuses (and drops) the snapshot that's waiting to be output.
+**/
+static snapshot_t *take_snapshot() {
+  snapshot_t *snapshot;
+  interval_results_t *interval;
+  process_t *process;
+  int i, dropped;
+  
+  dropped = 0;
+  pthread_mutex_lock(&snapshot_lock);
+  if(spare_snapshot) {
+    snapshot = spare_snapshot;
+    spare_snapshot = NULL;
+  } else if(pending_snapshot) {
+    snapshot = pending_snapshot;
+    pending_snapshot = NULL;
+    dropped_snapshots++;
+    dropped = 1;
+  } else {
+    snapshot = NULL;
   }
-#endif
-  free(results->interval);
-  free(results);
+  pthread_mutex_unlock(&snapshot_lock);
+  
+  if(!snapshot) {
+    snapshot = alloc_snapshot();
+  } else if(dropped) {
+    clear_interval_counts(snapshot->interval);
+  }
+  
+  /* The snapshot's empty interval becomes the next one */
+  interval = snapshot->interval;
+  snapshot->interval = results->interval;
+  results->interval = interval;
+  snapshot->interval_num = results->interval_num;
+  
+  results->num_samples += snapshot->interval->num_samples;
+  results->num_failed += snapshot->interval->num_failed;
+  results->interval_num++;
+  
+  interval = snapshot->interval;
+  if(snapshot->proc_names_size < interval->pid_ctr) {
+    free(snapshot->proc_names);
+    free(snapshot->group_ids);
+    snapshot->proc_names_size = interval->proc_arr_size;
+    snapshot->proc_names = calloc(snapshot->proc_names_size, sizeof(char *));
+    snapshot->group_ids = calloc(snapshot->proc_names_size, sizeof(uint64_t));
+    if(!snapshot->proc_names || !snapshot->group_ids) {
+      fprintf(stderr, "Failed to allocate memory! Aborting.\n");
+      exit(1);
+    }
+  }
+  
+  if(pw_opts.group_by == GROUP_BY_CGROUP) {
+    group_snapshot_by_cgroup(snapshot);
+    retire_exited_processes(snapshot->interval_num);
+    free_unused_strs(snapshot->interval_num);
+    snapshot->num_procs = results->process_info.num_procs;
+    return snapshot;
+  }
+  for(i = 0; i < interval->pid_ctr; i++) {
+    process = get_interval_process_info(interval->pids[i]);
+    snapshot->proc_names[i] = process ? process->name : NULL;
+  }
+  retire_exited_processes(snapshot->interval_num);
+  free_unused_strs(snapshot->interval_num);
+  snapshot->num_procs = results->process_info.num_procs;
+  
+  return snapshot;
+}
+
+/**
+  resolve_snapshot_cgroups: Names the snapshot's cgroups that weren't in
+  the cache when it was taken. Called after the write lock is released,
+  so that the consumers don't wait on the syscalls.
+**/
+static void resolve_snapshot_cgroups(snapshot_t *snapshot) {
+  int g;
+  
+  if(pw_opts.group_by != GROUP_BY_CGROUP) {
+    return;
+  }
+  for(g = 0; g < snapshot->interval->pid_ctr; g++) {
+    if(!snapshot->proc_names[g]) {
+      snapshot->proc_names[g] = get_cgroup_path(snapshot->group_ids[g]);
+    }
+  }
+}
+
+/**
+  publish_snapshot: Hands a snapshot to the output thread.
+**/
+static void publish_snapshot(snapshot_t *snapshot) {
+  pthread_mutex_lock(&snapshot_lock);
+  snapshot->dropped = dropped_snapshots;
+  pending_snapshot = snapshot;
+  pthread_cond_signal(&snapshot_cond);
+  pthread_mutex_unlock(&snapshot_lock);
+}
+
+/**
+  wait_snapshot: Called by the output thread. Returns the next snapshot,
+  or NULL once close_snapshots has been called and none are left.
+**/
+static snapshot_t *wait_snapshot() {
+  snapshot_t *snapshot;
+  
+  pthread_mutex_lock(&snapshot_lock);
+  while(!pending_snapshot && !snapshots_closed) {
+    pthread_cond_wait(&snapshot_cond, &snapshot_lock);
+  }
+  snapshot = pending_snapshot;
+  pending_snapshot = NULL;
+  outputting_snapshot = snapshot;
+  pthread_mutex_unlock(&snapshot_lock);
+  
+  return snapshot;
+}
+
+/**
+  release_snapshot: Called by the output thread when it's done with a snapshot.
+**/
+static void release_snapshot(snapshot_t *snapshot) {
+  clear_interval_counts(snapshot->interval);
+  
+  pthread_mutex_lock(&snapshot_lock);
+  outputting_snapshot = NULL;
+  if(!spare_snapshot) {
+    spare_snapshot = snapshot;
+    snapshot = NULL;
+  }
+  pthread_mutex_unlock(&snapshot_lock);
+  
+  free_snapshot(snapshot);
+}
+
+static void close_snapshots() {
+  pthread_mutex_lock(&snapshot_lock);
+  snapshots_closed = 1;
+  pthread_cond_broadcast(&snapshot_cond);
+  pthread_mutex_unlock(&snapshot_lock);
+}
+
+static uint64_t get_dropped_snapshots() {
+  uint64_t dropped;
+  
+  pthread_mutex_lock(&snapshot_lock);
+  dropped = dropped_snapshots;
+  pthread_mutex_unlock(&snapshot_lock);
+  
+  return dropped;
+}
+
+static void deinit_snapshots() {
+  free_snapshot(pending_snapshot);
+  free_snapshot(spare_snapshot);
+  pending_snapshot = NULL;
+  spare_snapshot = NULL;
 }
 
-static double get_ringbuf_used() {
+/**
+  get_ringbuf_used: Returns the fraction of the given ringbuffer shard
+  that is waiting to be consumed.
+**/
+static double get_ringbuf_used(int shard) {
+#ifdef INSNPROF_LEGACY_PERF_BUFFER
+  return 0;
+#else
   uint64_t size, avail;
+  struct ring *ring;
 
-  avail = ring__avail_data_size(ring_buffer__ring(bpf_info->rb, 0));
-  size = ring__size(ring_buffer__ring(bpf_info->rb, 0));
+  ring = ring_buffer__ring(bpf_info->rb, shard);
+  avail = ring__avail_data_size(ring);
+  size = ring__size(ring);
   return ((double) avail) / size;
+#endif
+}
+
+/**
+  read_insn_stats
+  **
+  Reads the BPF program's per-CPU counters, and stores how much each
+  grew since the last interval in results->interval.
+**/
+static int read_insn_stats() {
+  struct insn_stats *prev, *cur, *delta, *total;
+  uint32_t zero = 0;
+  int cpu, err;
+  
+  cur = calloc(bpf_info->nr_cpus, sizeof(struct insn_stats));
+  if(!cur) {
+    fprintf(stderr, "Failed to allocate memory! Aborting.\n");
+    exit(1);
+  }
+  err = bpf_map_lookup_elem(bpf_map__fd(bpf_info->obj->maps.stats), &zero, cur);
+  if(err) {
+    fprintf(stderr, "Failed to read the BPF program's stats: %s\n", strerror(errno));
+    free(cur);
+    return -1;
+  }
+  
+  prev = bpf_info->prev_stats;
+  total = &(results->interval->stats);
+  for(cpu = 0; cpu < bpf_info->nr_cpus; cpu++) {
+    delta = &(results->interval->cpu_stats[cpu]);
+    delta->samples = cur[cpu].samples - (prev ? prev[cpu].samples : 0);
+    delta->lost = cur[cpu].lost - (prev ? prev[cpu].lost : 0);
+    delta->fetch_failed = cur[cpu].fetch_failed - (prev ? prev[cpu].fetch_failed : 0);
+    delta->kernel = cur[cpu].kernel - (prev ? prev[cpu].kernel : 0);
+    delta->self_ns = cur[cpu].self_ns - (prev ? prev[cpu].self_ns : 0);
+    delta->lost_exits = cur[cpu].lost_exits - (prev ? prev[cpu].lost_exits : 0);
+    total->samples += delta->samples;
+    total->lost += delta->lost;
+    total->fetch_failed += delta->fetch_failed;
+    total->kernel += delta->kernel;
+    total->self_ns += delta->self_ns;
+    total->lost_exits += delta->lost_exits;
+  }
+  
+  free(prev);
+  bpf_info->prev_stats = cur;
+  return 0;
+}
+
+/**
+  get_max_ringbuf_used: Returns the fill fraction of the fullest shard.
+**/
+static double get_max_ringbuf_used() {
+  double used, max;
+  int i;
+  
+  max = 0;
+  for(i = 0; i < bpf_info->num_rb_shards; i++) {
+    used = get_ringbuf_used(i);
+    if(used > max) {
+      max = used;
+    }
+  }
+  
+  return max;
+}
+
+/**
+  update_ringbuf_used: Records how full each shard is this interval.
+**/
+static void update_ringbuf_used() {
+  int i;
+  
+  results->interval->ringbuf_used = 0;
+  for(i = 0; i < bpf_info->num_rb_shards; i++) {
+    results->interval->shard_ringbuf_used[i] = get_ringbuf_used(i);
+    if(results->interval->shard_ringbuf_used[i] > results->interval->ringbuf_used) {
+      results->interval->ringbuf_used = results->interval->shard_ringbuf_used[i];
+    }
+  }
 }
@@ -11,6 +11,9 @@
 #include <bpf/bpf.h>
 #include <linux/bpf.h>
 #include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
 
 #include "bpf/insn/insn.h"
 #include "bpf/insn/insn.skel.h"
@@ -21,13 +24,16 @@
 
 /**
   Loose wrapper around perf_event_open. Opens a perf_event_attr
-  on each CPU, for all processes, and then attaches that event
-  to the given BPF program and link.
+  on one CPU, and then attaches that event to the BPF program.
+  The link and fd go in that CPU's slot, so CPUs can be attached
+  from several threads at once.
 **/
-static int open_and_attach_perf_event(struct perf_event_attr *attr, int cpu, int pid, int group_fd) {
+static int open_and_attach_perf_event(struct perf_event_attr *attr, int cpu, int pid,
+                                      int group_fd, unsigned long flags) {
+  struct bpf_link *link;
   int fd;
 
-  fd = syscall(__NR_perf_event_open, attr, pid, cpu, group_fd, 0);
+  fd = syscall(__NR_perf_event_open, attr, pid, cpu, group_fd, flags);
   if(fd < 0) {
     /* Ignore CPU that is offline */
     if(errno == ENODEV) {
@@ -38,76 +44,96 @@ static int open_and_attach_perf_event(struct perf_event_attr *attr, int cpu, int
     return -1;
   }
   
-  /* Add a link to the array. Note that bpf_info->prog gets incremented
-     per perf event. */
-  bpf_info->num_links++;
-  bpf_info->links = realloc(bpf_info->links, sizeof(struct bpf_link *) * bpf_info->num_links);
-  if(!bpf_info->links) {
-    fprintf(stderr, "Failed to allocate memory! Aborting.\n");
-    exit(1);
-  }
-  bpf_info->links[bpf_info->num_links - 1] = bpf_program__attach_perf_event(*(bpf_info->prog), fd);
-  if(libbpf_get_error(bpf_info->links[bpf_info->num_links - 1])) {
+  link = bpf_program__attach_perf_event(*(bpf_info->prog), fd);
+  if(libbpf_get_error(link)) {
     fprintf(stderr, "failed to attach perf event on cpu: "
       "%d\n", cpu);
-    /* Set this pointer to NULL, since it's undefined what it will be */
-    bpf_info->links[bpf_info->num_links - 1] = NULL;
     close(fd);
     return -1;
   }
   
+  /* The link owns the fd, but we keep it to change the period */
+  bpf_info->links[cpu] = link;
+  bpf_info->perf_fds[cpu] = fd;
+  
   return fd;
 }
 
 /**
-  single_insn_event - Handles a single CPU, PMU, socket event.
-  Returns:
-    >0 if successful.
-    -1 if there was an issue with perf.
-    -2 if the CPU was offline.
+  resolve_insn_event - Fills in the perf_event_attr that counts retired
+  instructions (or the nearest thing) on this machine. Finding the PMU
+  reads sysfs or runs cpuid, so this is done once, not once per CPU.
+  Returns -1 if the PMU isn't usable.
 **/
-static int single_insn_event(int cpu, int pid) {
-  int retval;
+static int resolve_insn_event(struct perf_event_attr *attr) {
+  int type;
   
   /* Architecture-independent settings */
-  struct perf_event_attr attr = {
-    .sample_period = pw_opts.sample_period,
-    .sample_type = PERF_SAMPLE_IDENTIFIER,
-    .read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING,
-    .exclude_guest = 1,
-    .inherit = 1,
-    .size = sizeof(struct perf_event_attr),
-  };
+  memset(attr, 0, sizeof(struct perf_event_attr));
+  attr->sample_period = pw_opts.sample_period;
+  attr->sample_type = PERF_SAMPLE_IDENTIFIER;
+  attr->read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  attr->exclude_guest = 1;
+  attr->inherit = 1;
+  attr->size = sizeof(struct perf_event_attr);
   
 #ifdef __aarch64__
-  attr.type = PERF_TYPE_RAW;
-  attr.config = 0x08;
+  attr->type = PERF_TYPE_RAW;
+  attr->config = 0x08;
 #elif __x86_64__
   get_pmu_string(bpf_info->pmu_name);
   /* Program INST_RETIRED.ANY (or equivalent) depending on PMU version */
   if(strncmp(bpf_info->pmu_name, "skylake", 7) == 0) {
-    attr.type = PERF_TYPE_RAW;
-    attr.config = 0x00c0;
+    attr->type = PERF_TYPE_RAW;
+    attr->config = 0x00c0;
   } else if(strncmp(bpf_info->pmu_name, "icelake", 7) == 0) {
-    attr.type = PERF_TYPE_RAW;
-    attr.config = 0x00c0;
+    attr->type = PERF_TYPE_RAW;
+    attr->config = 0x00c0;
   } else if(strncmp(bpf_info->pmu_name, "sapphire_rapids", 7) == 0) {
-    attr.type = PERF_TYPE_RAW;
-    attr.config = 0x00c0;
+    attr->type = PERF_TYPE_RAW;
+    attr->config = 0x00c0;
   } else if(strncmp(bpf_info->pmu_name, "ibs_op", 6) == 0) {
-    attr.type = get_ibs_op_type();
-    if (attr.type < 0)
+    type = get_ibs_op_type();
+    if (type < 0)
 	    return -1;
-    attr.config = 0x80000;
-    attr.exclude_guest = 0;
+    attr->type = type;
+    attr->config = 0x80000;
+    attr->exclude_guest = 0;
   } else {
-    attr.type = PERF_TYPE_SOFTWARE;
-    attr.config = PERF_COUNT_SW_CPU_CLOCK;
+    attr->type = PERF_TYPE_SOFTWARE;
+    attr->config = PERF_COUNT_SW_CPU_CLOCK;
   }
 #endif
 
-  /* Attach the event, and handle the BPF linkages. */
-  retval = open_and_attach_perf_event(&attr, cpu, pid, -1);
+  return 0;
+}
+
+/**
+  single_insn_event - Handles a single CPU, PMU, socket event.
+  Returns:
+    >0 if successful.
+    -1 if there was an issue with perf.
+    -2 if the CPU was offline.
+**/
+static int single_insn_event(int cpu, int pid) {
+  struct perf_event_attr attr;
+  int retval;
+  
+  /* Each event gets its own copy, since the kernel may write to it.
+     CPUs that come online later use the governor's current period. */
+  attr = bpf_info->event_attr;
+  if(bpf_info->sample_period) {
+    attr.sample_period = bpf_info->sample_period;
+  }
+
+  /* Attach the event, and handle the BPF linkages. With a cgroup, the
+     kernel only counts while that cgroup's tasks are on this CPU. */
+  if(bpf_info->cgroup_fd >= 0) {
+    retval = open_and_attach_perf_event(&attr, cpu, bpf_info->cgroup_fd, -1,
+                                        PERF_FLAG_PID_CGROUP);
+  } else {
+    retval = open_and_attach_perf_event(&attr, cpu, pid, -1, 0);
+  }
   if(retval == -1) {
     fprintf(stderr, "Failed to open perf event.\n");
     return -1;
@@ -115,12 +141,351 @@ static int single_insn_event(int cpu, int pid) {
     fprintf(stderr, "WARNING: CPU %d is offline.\n", cpu);
     return -2;
   }
+  
+  /* Attaching enables the event, but CPUs that come online
+     between duty cycle windows should wait for the next one */
+  if(bpf_info->events_disabled) {
+    ioctl(retval, PERF_EVENT_IOC_DISABLE, 0);
+  }
 
   return retval;
 }
 
+/**
+  init_consumers: Allocates the per-thread state for each consumer:
+  one per ringbuffer shard, plus one for the aggregation map.
+**/
+static void init_consumers() {
+  int i;
+  
+  bpf_info->num_consumers = bpf_info->num_rb_shards + 1;
+  bpf_info->consumers = calloc(bpf_info->num_consumers, sizeof(consumer_t));
+  if(!bpf_info->consumers) {
+    fprintf(stderr, "Failed to allocate memory! Aborting.\n");
+    exit(1);
+  }
+  
+  for(i = 0; i < bpf_info->num_consumers; i++) {
+    bpf_info->consumers[i].index = i;
+    bpf_info->consumers[i].insn_cache = calloc(INSN_CACHE_SIZE, sizeof(insn_cache_entry_t));
+    if(!bpf_info->consumers[i].insn_cache) {
+      fprintf(stderr, "Failed to allocate memory! Aborting.\n");
+      exit(1);
+    }
+    
+    /* The aggregation map's consumer writes directly to results->interval */
+    bpf_info->consumers[i].wake_fd = -1;
+    if(i < bpf_info->num_rb_shards) {
+      bpf_info->consumers[i].buffers[0] = alloc_interval_results();
+      bpf_info->consumers[i].buffers[1] = alloc_interval_results();
+      bpf_info->consumers[i].wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if(bpf_info->consumers[i].wake_fd < 0) {
+        fprintf(stderr, "Failed to create an eventfd: %s\n", strerror(errno));
+        exit(1);
+      }
+    }
+#ifdef __aarch64__
+    /* Capstone handles aren't shared between threads */
+    if(cs_open(CS_ARCH_AARCH64, CS_MODE_ARM, &(bpf_info->consumers[i].handle)) != CS_ERR_OK) {
+      fprintf(stderr, "Failed to initialise Capstone! Aborting.\n");
+      exit(1);
+    }
+    cs_option(bpf_info->consumers[i].handle, CS_OPT_DETAIL, CS_OPT_ON);
+    cs_option(bpf_info->consumers[i].handle, CS_OPT_SKIPDATA, CS_OPT_ON);
+#endif
+  }
+}
+
+/**
+  read_cpu_list: Turns -C into a byte per CPU. Without it, every CPU
+  is wanted. Everything that scales with the number of CPUs, like the
+  events, the ringbuffer and its shards, only counts the wanted ones.
+**/
+static int read_cpu_list() {
+  int cpu;
+  
+  bpf_info->num_wanted_cpus = bpf_info->nr_cpus;
+  if(!pw_opts.cpu_list) {
+    return 0;
+  }
+  
+  bpf_info->cpu_wanted = malloc(bpf_info->nr_cpus);
+  if(!bpf_info->cpu_wanted) {
+    fprintf(stderr, "Failed to allocate memory! Aborting.\n");
+    exit(1);
+  }
+  if(parse_cpulist(pw_opts.cpu_list, bpf_info->cpu_wanted, bpf_info->nr_cpus) != 0) {
+    fprintf(stderr, "Invalid CPU list '%s'. This system has CPUs 0-%d.\n",
+            pw_opts.cpu_list, bpf_info->nr_cpus - 1);
+    return -1;
+  }
+  
+  bpf_info->num_wanted_cpus = 0;
+  for(cpu = 0; cpu < bpf_info->nr_cpus; cpu++) {
+    if(bpf_info->cpu_wanted[cpu]) {
+      bpf_info->num_wanted_cpus++;
+    }
+  }
+  if(bpf_info->num_wanted_cpus == 0) {
+    fprintf(stderr, "The CPU list '%s' is empty.\n", pw_opts.cpu_list);
+    return -1;
+  }
+  
+  return 0;
+}
+
+static int cpu_is_wanted(int cpu) {
+  return !bpf_info->cpu_wanted || bpf_info->cpu_wanted[cpu];
+}
+
+/**
+  compute_rb_size: Sizes the ringbuffer (or perf buffers) to hold about one
+  interval's worth of samples from every sampled CPU, at the starting sampling
+  period. Consumers are woken up well before that fills, so this is
+  headroom for bursts, and for consumers that fall behind.
+  Rounded up to a power of two number of pages.
+**/
+
+/* About one instruction per cycle at 4GHz, which is on the high side */
+#define ASSUMED_INSNS_PER_SEC 4000000000ULL
+
+/* An insn_info in the ringbuffer, with its header, rounded up to 8 bytes */
+#define RB_RECORD_SIZE 32
+
+#define RB_MIN_SIZE (256 * 1024ULL)
+#define RB_MAX_SIZE (1ULL << 31)
+
+static void compute_rb_size() {
+  uint64_t size, page_size, period;
+  
+  page_size = sysconf(_SC_PAGESIZE);
+  period = pw_opts.sample_period ? pw_opts.sample_period : 1;
+  
+  if(pw_opts.rb_size_mb) {
+    size = (uint64_t) pw_opts.rb_size_mb * 1024 * 1024;
+  } else if(pw_opts.aggregate) {
+    /* Samples don't go through the ringbuffer, only process names */
+    size = COMM_ONLY_ENTRIES;
+  } else {
+    size = bpf_info->num_wanted_cpus * (ASSUMED_INSNS_PER_SEC / period) *
+           RB_RECORD_SIZE * pw_opts.interval_time;
+    if(size < RB_MIN_SIZE) {
+      size = RB_MIN_SIZE;
+    }
+  }
+  
+  bpf_info->rb_size = page_size;
+  while((bpf_info->rb_size < size) && (bpf_info->rb_size < RB_MAX_SIZE)) {
+    bpf_info->rb_size *= 2;
+  }
+}
+
+#ifndef INSNPROF_LEGACY_PERF_BUFFER
+
+/**
+  size_rb_shards: Before the BPF object is loaded, splits the ringbuffer's
+  size between the shards. Each shard's size is rounded down to
+  a power of two.
+**/
+static void size_rb_shards() {
+  struct bpf_map *inner;
+  uint64_t page_size, cpus_per_shard, total_size;
+  
+  page_size = sysconf(_SC_PAGESIZE);
+  total_size = bpf_info->rb_size;
+  inner = bpf_map__inner_map(bpf_info->obj->maps.rb_shards);
+  
+  if(bpf_info->num_rb_shards <= 1) {
+    /* The template for the shards is unused, so keep it small */
+    bpf_info->num_rb_shards = 1;
+    bpf_map__set_max_entries(inner, page_size);
+    return;
+  }
+  
+  /* Group the sampled CPUs evenly, without leaving any shard empty */
+  if(bpf_info->num_rb_shards > bpf_info->num_wanted_cpus) {
+    bpf_info->num_rb_shards = bpf_info->num_wanted_cpus;
+  }
+  cpus_per_shard = (bpf_info->num_wanted_cpus + bpf_info->num_rb_shards - 1) / bpf_info->num_rb_shards;
+  bpf_info->num_rb_shards = (bpf_info->num_wanted_cpus + cpus_per_shard - 1) / cpus_per_shard;
+  
+  bpf_info->rb_shard_size = page_size;
+  while(bpf_info->rb_shard_size * 2 <= total_size / bpf_info->num_rb_shards) {
+    bpf_info->rb_shard_size *= 2;
+  }
+  
+  bpf_map__set_max_entries(inner, bpf_info->rb_shard_size);
+  bpf_map__set_max_entries(bpf_info->obj->maps.rb_shards, bpf_info->nr_cpus);
+  bpf_map__set_max_entries(bpf_info->obj->maps.rb, page_size);
+  bpf_info->obj->rodata->sharded = true;
+}
+
+/**
+  set_wakeup_watermark: Have BPF wake up a shard's consumer once the shard
+  is a quarter full. Below that, it's read at the end of each interval.
+**/
+static void set_wakeup_watermark() {
+  uint64_t size;
+  
+  if(bpf_info->num_rb_shards > 1) {
+    size = bpf_info->rb_shard_size;
+  } else {
+    size = bpf_map__max_entries(bpf_info->obj->maps.rb);
+  }
+  bpf_info->obj->rodata->wakeup_bytes = size / 4;
+}
+
+/**
+  create_rb_shards: After the BPF object is loaded, creates each shard
+  and points the slot of each CPU in its group at it. CPUs that aren't
+  sampled never get an event, but processes can still exit on them, so
+  their slots point at the first shard.
+**/
+static int create_rb_shards() {
+  int i, outer_fd, cpus_per_shard, num_assigned;
+  uint32_t cpu;
+  
+  bpf_info->rb_shard_fds = malloc(bpf_info->num_rb_shards * sizeof(int));
+  if(!bpf_info->rb_shard_fds) {
+    fprintf(stderr, "Failed to allocate memory! Aborting.\n");
+    exit(1);
+  }
+  
+  /* So that teardown can tell which ones were created */
+  for(i = 0; i < bpf_info->num_rb_shards; i++) {
+    bpf_info->rb_shard_fds[i] = -1;
+  }
+  for(i = 0; i < bpf_info->num_rb_shards; i++) {
+    bpf_info->rb_shard_fds[i] = bpf_map_create(BPF_MAP_TYPE_RINGBUF, "rb_shard", 0, 0,
+                                               bpf_info->rb_shard_size, NULL);
+    if(bpf_info->rb_shard_fds[i] < 0) {
+      fprintf(stderr, "Failed to create ringbuffer shard %d: %s\n", i, strerror(errno));
+      return -1;
+    }
+  }
+  
+  outer_fd = bpf_map__fd(bpf_info->obj->maps.rb_shards);
+  cpus_per_shard = (bpf_info->num_wanted_cpus + bpf_info->num_rb_shards - 1) / bpf_info->num_rb_shards;
+  num_assigned = 0;
+  for(cpu = 0; cpu < bpf_info->nr_cpus; cpu++) {
+    i = 0;
+    if(cpu_is_wanted(cpu)) {
+      i = num_assigned / cpus_per_shard;
+      num_assigned++;
+    }
+    if(bpf_map_update_elem(outer_fd, &cpu, &(bpf_info->rb_shard_fds[i]), BPF_ANY)) {
+      fprintf(stderr, "Failed to assign CPU %u to a ringbuffer shard: %s\n", cpu, strerror(errno));
+      return -1;
+    }
+  }
+  
+  return 0;
+}
+
+#endif
+
+/* How many bytes of each sampled instruction the BPF program reads */
+#ifdef __aarch64__
+#define INSN_FETCH_LEN 4
+#else
+#define INSN_FETCH_LEN 15
+#endif
+
+/**
+  configure_insn_bpf: Sets the BPF program's read-only configuration,
+  which must happen before it's loaded.
+**/
+static void configure_insn_bpf() {
+  bpf_info->obj->rodata->fetch_len = INSN_FETCH_LEN;
+  bpf_info->obj->rodata->self_tgid = getpid();
+  bpf_info->obj->rodata->exclude_kthreads = true;
+  bpf_info->obj->rodata->filter_tgids = (pw_opts.num_pids > 0);
+  bpf_info->obj->rodata->num_comm_prefixes = pw_opts.num_comms;
+  bpf_info->obj->rodata->capture_cgroup = (pw_opts.group_by == GROUP_BY_CGROUP);
+  bpf_info->obj->rodata->per_thread = pw_opts.threads;
+}
+
+/**
+  fill_filter_maps: Gives the loaded BPF program the -p and --comm lists.
+**/
+static int fill_filter_maps() {
+  struct comm_prefix prefix;
+  unsigned char *mask;
+  uint32_t i, pid;
+  uint8_t one = 1;
+  size_t len;
+  
+  for(i = 0; i < pw_opts.num_pids; i++) {
+    pid = pw_opts.pids[i];
+    if(bpf_map_update_elem(bpf_map__fd(bpf_info->obj->maps.allowed_tgids), &pid, &one, BPF_ANY)) {
+      fprintf(stderr, "Failed to add PID %u to the filter: %s\n", pid, strerror(errno));
+      return -1;
+    }
+  }
+  
+  for(i = 0; i < pw_opts.num_comms; i++) {
+    memset(&prefix, 0, sizeof(prefix));
+    len = strlen(pw_opts.comms[i]);
+    memcpy(prefix.prefix, pw_opts.comms[i], len);
+    mask = (unsigned char *) prefix.mask;
+    memset(mask, 0xff, len);
+    if(bpf_map_update_elem(bpf_map__fd(bpf_info->obj->maps.comm_prefixes), &i, &prefix, BPF_ANY)) {
+      fprintf(stderr, "Failed to add '%s' to the filter: %s\n", pw_opts.comms[i], strerror(errno));
+      return -1;
+    }
+  }
+  
+  return 0;
+}
+
+/**
+  attach_lifecycle_tracepoints: Attaches to the exec, exit and fork
+  tracepoints, so that we can free processes once they're gone. They're
+  only needed if the BPF program is sending us process names.
+**/
+static int attach_lifecycle_tracepoints() {
+  struct bpf_program *progs[3];
+  int i;
+  
+  if(!bpf_info->obj->rodata->capture_comm) {
+    return 0;
+  }
+  
+  progs[0] = bpf_info->obj->progs.handle_exec;
+  progs[1] = bpf_info->obj->progs.handle_exit;
+  progs[2] = bpf_info->obj->progs.handle_fork;
+  for(i = 0; i < 3; i++) {
+    bpf_info->lifecycle_links[i] = bpf_program__attach(progs[i]);
+    if(libbpf_get_error(bpf_info->lifecycle_links[i])) {
+      fprintf(stderr, "Failed to attach to the process lifecycle tracepoints.\n");
+      bpf_info->lifecycle_links[i] = NULL;
+      return -1;
+    }
+  }
+  
+  return 0;
+}
+
+/**
+  attach_self_time_tracepoint: In debug mode, attaches to the context
+  switch tracepoint to count how long our own threads run on each CPU.
+  It runs on every context switch, so it's skipped otherwise, and it
+  isn't worth failing over.
+**/
+static void attach_self_time_tracepoint() {
+  if(!pw_opts.debug) {
+    return;
+  }
+  
+  bpf_info->self_time_link = bpf_program__attach(bpf_info->obj->progs.handle_switch);
+  if(libbpf_get_error(bpf_info->self_time_link)) {
+    fprintf(stderr, "Failed to attach to the context switch tracepoint. Not counting our own CPU time.\n");
+    bpf_info->self_time_link = NULL;
+  }
+}
+
 static int init_insn_bpf_info() {
-  int err;
+  int err, i;
   struct bpf_object_open_opts opts = {0};
   
   opts.sz = sizeof(struct bpf_object_open_opts);
@@ -136,39 +501,104 @@ static int init_insn_bpf_info() {
     fprintf(stderr, "       2. You don't have a kernel that supports BTF type information.\n");
     return -1;
   }
+  
+  bpf_info->nr_cpus = libbpf_num_possible_cpus();
+  bpf_info->num_rb_shards = pw_opts.rb_shards;
+  if(read_cpu_list() != 0) {
+    return -1;
+  }
+  
+  compute_rb_size();
+  configure_insn_bpf();
+  
+#ifndef INSNPROF_LEGACY_PERF_BUFFER
+  if(pw_opts.aggregate) {
+    bpf_info->obj->rodata->aggregate = true;
+  }
+  bpf_map__set_max_entries(bpf_info->obj->maps.rb, bpf_info->rb_size);
+  size_rb_shards();
+  set_wakeup_watermark();
+#endif
+  
   err = insn_bpf__load(bpf_info->obj);
   if(err) {
     fprintf(stderr, "Failed to load BPF object!\n");
     return -1;
   }
+  if(fill_filter_maps() != 0) {
+    return -1;
+  }
+  if(attach_lifecycle_tracepoints() != 0) {
+    return -1;
+  }
+  attach_self_time_tracepoint();
 
   bpf_info->prog = (struct bpf_program **) &(bpf_info->obj->progs.insn_collect);
-  bpf_info->links = NULL;
-  bpf_info->num_links = 0;
+  
+  /* One link per CPU, indexed by CPU, which stays NULL if it's offline */
+  bpf_info->num_links = bpf_info->nr_cpus;
+  bpf_info->links = calloc(bpf_info->num_links, sizeof(struct bpf_link *));
+  bpf_info->perf_fds = malloc(bpf_info->num_links * sizeof(int));
+  if(!bpf_info->links || !bpf_info->perf_fds) {
+    fprintf(stderr, "Failed to allocate memory! Aborting.\n");
+    exit(1);
+  }
+  for(i = 0; i < bpf_info->num_links; i++) {
+    bpf_info->perf_fds[i] = -1;
+  }
   
   /* Construct the ringbuffer or perfbuffer */
 #ifdef INSNPROF_LEGACY_PERF_BUFFER
   struct perf_buffer_opts pb_opts = {};
+  size_t page_cnt;
+  
+  /* Split the size between the CPUs. Each gets a power of two pages. */
+  page_cnt = 1;
+  while(page_cnt * 2 * sysconf(_SC_PAGESIZE) * bpf_info->nr_cpus <= bpf_info->rb_size) {
+    page_cnt *= 2;
+  }
+  bpf_info->rb_size = page_cnt * sysconf(_SC_PAGESIZE) * bpf_info->nr_cpus;
+  
   pb_opts.sz = sizeof(struct perf_buffer_opts);
+  init_consumers();
   bpf_info->pb = perf_buffer__new(bpf_map__fd(bpf_info->obj->maps.pb),
-                                  MAX_ENTRIES / (4096 * 1024),
+                                  page_cnt,
                                   handle_sample,
                                   NULL,
-                                  NULL,
+                                  &(bpf_info->consumers[0]),
                                   &pb_opts);
   if(!(bpf_info->pb)) {
     fprintf(stderr, "Failed to create a new perf buffer. You're most likely not root.\n");
     return -1;
   }
 #else
-  bpf_info->rb = ring_buffer__new(bpf_map__fd(bpf_info->obj->maps.rb), handle_sample, NULL, NULL);
+  init_consumers();
+  if(bpf_info->num_rb_shards > 1) {
+    if(create_rb_shards() != 0) {
+      return -1;
+    }
+    
+    /* Each shard becomes a ring in the same ring_buffer, in order,
+       and each gets its own consumer as the context */
+    bpf_info->rb = ring_buffer__new(bpf_info->rb_shard_fds[0], handle_sample,
+                                    &(bpf_info->consumers[0]), NULL);
+    for(i = 1; (i < bpf_info->num_rb_shards) && bpf_info->rb; i++) {
+      if(ring_buffer__add(bpf_info->rb, bpf_info->rb_shard_fds[i], handle_sample,
+                          &(bpf_info->consumers[i]))) {
+        fprintf(stderr, "Failed to add ringbuffer shard %d.\n", i);
+        return -1;
+      }
+    }
+  } else {
+    bpf_info->rb = ring_buffer__new(bpf_map__fd(bpf_info->obj->maps.rb), handle_sample,
+                                    &(bpf_info->consumers[0]), NULL);
+  }
   if(!(bpf_info->rb)) {
     fprintf(stderr, "Failed to create a new ring buffer. You're most likely not root.\n");
     return -1;
   }
 #endif
   
-  bpf_info->nr_cpus = libbpf_num_possible_cpus();
   return 0;
 }
   
@@ -194,41 +624,195 @@ static void deinit_bpf_info() {
   if(bpf_info->rb) {
     ring_buffer__free(bpf_info->rb);
   }
+  if(bpf_info->rb_shard_fds) {
+    for(i = 0; i < bpf_info->num_rb_shards; i++) {
+      if(bpf_info->rb_shard_fds[i] >= 0) {
+        close(bpf_info->rb_shard_fds[i]);
+      }
+    }
+    free(bpf_info->rb_shard_fds);
+  }
 #endif
   
+  if(bpf_info->consumers) {
+    for(i = 0; i < bpf_info->num_consumers; i++) {
+      free_interval_results(bpf_info->consumers[i].buffers[0]);
+      free_interval_results(bpf_info->consumers[i].buffers[1]);
+      free(bpf_info->consumers[i].insn_cache);
+      if(bpf_info->consumers[i].wake_fd >= 0) {
+        close(bpf_info->consumers[i].wake_fd);
+      }
+#ifdef __aarch64__
+      cs_close(&(bpf_info->consumers[i].handle));
+#endif
+    }
+    free(bpf_info->consumers);
+  }
+  
   if(bpf_info->links) {
     for(i = 0; i < bpf_info->num_links; i++) {
       bpf_link__destroy(bpf_info->links[i]);
     }
     free(bpf_info->links);
   }
+  for(i = 0; i < 3; i++) {
+    if(bpf_info->lifecycle_links[i]) {
+      bpf_link__destroy(bpf_info->lifecycle_links[i]);
+    }
+  }
+  if(bpf_info->self_time_link) {
+    bpf_link__destroy(bpf_info->self_time_link);
+  }
+  free(bpf_info->perf_fds);
+  free(bpf_info->prev_stats);
+  free(bpf_info->cpu_online);
+  free(bpf_info->cpu_wanted);
+  if(bpf_info->cgroup_fd >= 0) {
+    close(bpf_info->cgroup_fd);
+  }
   free(bpf_info);
 }
 
-static int program_events(int pid) {
-  int retval, cpu;
+/**
+  ATTACH THREADS: on machines with hundreds of CPUs, opening and attaching
+  each CPU's event one at a time dominates startup. A few threads take
+  CPUs from a shared counter instead.
+**/
+#define ATTACH_THREADS 8
+
+static atomic_int attach_next_cpu;
+static atomic_int attach_failed;
+
+static void *attach_thread_main(void *arg) {
+  int cpu;
   
-  if(init_insn_bpf_info() == -1) {
-    return -1;
+  while(!atomic_load(&attach_failed)) {
+    cpu = atomic_fetch_add(&attach_next_cpu, 1);
+    if(cpu >= bpf_info->nr_cpus) {
+      break;
+    }
+    if(!cpu_is_wanted(cpu)) {
+      continue;
+    }
+    if(single_insn_event(cpu, -1) == -1) {
+      atomic_store(&attach_failed, 1);
+    }
   }
   
-  retval = 0;
-  if(pid == -1) {
-    for(cpu = 0; cpu < bpf_info->nr_cpus; cpu++) {
-      retval = single_insn_event(cpu, pid);
-      if(retval == -2) { // cpu is offline
-        continue;
-      }
-      if(retval < 0) {
-        return -1;
-      }
+  return NULL;
+}
+
+/**
+  attach_all_cpus: Opens and attaches an event on every CPU that -C asked
+  for. Offline CPUs are skipped. Returns -1 if any other CPU failed.
+**/
+static int attach_all_cpus() {
+  pthread_t threads[ATTACH_THREADS];
+  struct timespec start, end;
+  int i, num_threads;
+  
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  
+  atomic_store(&attach_next_cpu, 0);
+  atomic_store(&attach_failed, 0);
+  num_threads = bpf_info->num_wanted_cpus < ATTACH_THREADS ? bpf_info->num_wanted_cpus : ATTACH_THREADS;
+  for(i = 0; i < num_threads; i++) {
+    if(pthread_create(&(threads[i]), NULL, attach_thread_main, NULL) != 0) {
+      /* Whatever threads we did start will cover the rest */
+      num_threads = i;
+      break;
     }
-  } else {
-    retval = single_insn_event(-1, pid);
-    if(retval < 0) {
+  }
+  if(num_threads == 0) {
+    attach_thread_main(NULL);
+  }
+  for(i = 0; i < num_threads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  bpf_info->attach_ns = (end.tv_sec - start.tv_sec) * 1000000000ULL +
+                        end.tv_nsec - start.tv_nsec;
+  
+  return atomic_load(&attach_failed) ? -1 : 0;
+}
+
+/**
+  update_online_cpus: Called each interval to follow CPU hotplug. Attaches
+  to CPUs that have come online, and detaches from ones that have gone
+  offline, since their events stop counting. CPUs outside of -C are
+  treated as offline. Failing to attach to a CPU isn't fatal: it's
+  retried next interval.
+**/
+static void update_online_cpus() {
+  int cpu;
+  
+  if(!bpf_info->cpu_online) {
+    bpf_info->cpu_online = malloc(bpf_info->nr_cpus);
+    if(!bpf_info->cpu_online) {
+      fprintf(stderr, "Failed to allocate memory! Aborting.\n");
+      exit(1);
+    }
+  }
+  if(read_online_cpus(bpf_info->cpu_online, bpf_info->nr_cpus) != 0) {
+    return;
+  }
+  
+  for(cpu = 0; cpu < bpf_info->nr_cpus; cpu++) {
+    if(!cpu_is_wanted(cpu)) {
+      bpf_info->cpu_online[cpu] = 0;
+    }
+    if(bpf_info->cpu_online[cpu] && !bpf_info->links[cpu]) {
+      single_insn_event(cpu, -1);
+    } else if(!bpf_info->cpu_online[cpu] && bpf_info->links[cpu]) {
+      /* The link closes the perf event */
+      bpf_link__destroy(bpf_info->links[cpu]);
+      bpf_info->links[cpu] = NULL;
+      bpf_info->perf_fds[cpu] = -1;
+    }
+  }
+}
+
+/**
+  get_num_attached_cpus: How many CPUs have an event right now.
+**/
+static int get_num_attached_cpus() {
+  int cpu, num;
+  
+  num = 0;
+  for(cpu = 0; cpu < bpf_info->nr_cpus; cpu++) {
+    if(bpf_info->links[cpu]) {
+      num++;
+    }
+  }
+  return num;
+}
+
+/**
+  program_events: Loads the BPF program and opens an event on each CPU.
+  The BPF program drops the samples of processes that weren't asked for,
+  which covers all of their threads, including ones that already exist.
+**/
+static int program_events() {
+  
+  bpf_info->cgroup_fd = -1;
+  if(pw_opts.cgroup_path) {
+    bpf_info->cgroup_fd = open(pw_opts.cgroup_path, O_RDONLY | O_DIRECTORY);
+    if(bpf_info->cgroup_fd < 0) {
+      fprintf(stderr, "Failed to open cgroup %s: %s\n", pw_opts.cgroup_path, strerror(errno));
       return -1;
     }
   }
   
-  return retval;
+  if(init_insn_bpf_info() == -1) {
+    return -1;
+  }
+  
+  /* Every CPU's event is the same, so only find the PMU once */
+  if(resolve_insn_event(&(bpf_info->event_attr)) == -1) {
+    fprintf(stderr, "Failed to find a usable PMU event.\n");
+    return -1;
+  }
+  
+  return attach_all_cpus();
 }
@@ -11,24 +11,48 @@ static void print_csv_header(FILE *csv_file) {
   
   if(!csv_file) return;
   
-  fprintf(csv_file, "interval,pid,name,");
+  /* The period only varies if the governor is on */
+  fprintf(csv_file, "interval,");
+  if(governor_enabled()) {
+    fprintf(csv_file, "sample_period,");
+  }
+  if(pw_opts.group_by == GROUP_BY_CGROUP) {
+    fprintf(csv_file, "procs,cgroup,");
+  } else if(pw_opts.threads) {
+    fprintf(csv_file, "tid,name,");
+  } else {
+    fprintf(csv_file, "pid,name,");
+  }
   for(i = 0; i < pw_opts.cols_len; i++) {
     fprintf(csv_file, "%s", get_name(pw_opts.cols[i]));
     if(i != (pw_opts.cols_len - 1))  {
       fprintf(csv_file, ",");
     }
   }
+  fprintf(csv_file, ",lost,fetch_failed,kernel");
   fprintf(csv_file, "\n");
 }
 
+/**
+  print_csv_losses: Prints the loss-rate columns, which are only
+  known for all samples, or for each CPU's.
+**/
+static void print_csv_losses(FILE *csv_file, int cpu) {
+  fprintf(csv_file, ",%lf,%lf,%lf", get_lost_percent(cpu),
+          get_fetch_failed_percent(cpu), get_kernel_percent(cpu));
+}
+
 static void print_csv_interval(FILE *csv_file) {
   int i, n, counter;
-  process_t *process;
+  char *name;
   
   if(!csv_file) return;
   
   /* Print overall first */
-  fprintf(csv_file, "%" PRIu64 ",", results->interval_num);
+  fprintf(csv_file, "%" PRIu64 ",", output_snapshot->interval_num);
+  if(governor_enabled()) {
+    fprintf(csv_file, "%" PRIu64 ",", get_interval_sample_period());
+  }
   fprintf(csv_file, "%s,", "ALL");
   fprintf(csv_file, "%s,", "ALL");
   for(i = 0; i < pw_opts.cols_len; i++) {
@@ -37,24 +61,45 @@ static void print_csv_interval(FILE *csv_file) {
       fprintf(csv_file, ",");
     }
   }
+  print_csv_losses(csv_file, -1);
   fprintf(csv_file, "\n");
   
+  /* Then each CPU that lost samples, with empty columns */
+  for(i = 0; i < bpf_info->nr_cpus; i++) {
+    if(!cpu_had_losses(i)) continue;
+    fprintf(csv_file, "%" PRIu64 ",", output_snapshot->interval_num);
+    if(governor_enabled()) {
+      fprintf(csv_file, "%" PRIu64 ",", get_interval_sample_period());
+    }
+    fprintf(csv_file, "%s,", "CPU");
+    fprintf(csv_file, "%d,", i);
+    for(n = 0; n < pw_opts.cols_len - 1; n++) {
+      fprintf(csv_file, ",");
+    }
+    print_csv_losses(csv_file, i);
+    fprintf(csv_file, "\n");
+  }
+  
   /* Now one line per process */
   counter = 0;
-  for(i = 0; i < results->interval->pid_ctr; i++) {
-    process = get_interval_process_info(results->interval->pids[i]);
-    if(!process) continue;
+  for(i = 0; i < output_snapshot->interval->pid_ctr; i++) {
+    name = output_snapshot->proc_names[i];
+    if(!name) continue;
     if(!get_interval_proc_num_samples(i)) continue;
     counter++;
-    fprintf(csv_file, "%" PRIu64 ",", results->interval_num);
-    fprintf(csv_file, "%d,", results->interval->pids[i]);
-    fprintf(csv_file, "%s,", process->name);
+    fprintf(csv_file, "%" PRIu64 ",", output_snapshot->interval_num);
+    if(governor_enabled()) {
+      fprintf(csv_file, "%" PRIu64 ",", get_interval_sample_period());
+    }
+    fprintf(csv_file, "%d,", output_snapshot->interval->pids[i]);
+    fprintf(csv_file, "%s,", name);
     for(n = 0; n < pw_opts.cols_len; n++) {
-      fprintf(csv_file, "%lf", get_interval_proc_percent(process->index, pw_opts.cols[n]));
+      fprintf(csv_file, "%lf", get_interval_proc_percent(i, pw_opts.cols[n]));
       if(n != (pw_opts.cols_len - 1))  {
         fprintf(csv_file, ",");
       }
     }
+    fprintf(csv_file, ",,,");
     fprintf(csv_file, "\n");
   }
   if(counter) {
@@ -46,7 +46,7 @@ char *truncate_uint64(uint64_t val, char *str, int size) {
 
 void update_screen(struct sorted_interval **sortint_arg) {
   int i, n, index;
-  process_t *process;
+  char *name;
   char *column_name;
   struct sorted_interval *sortint = *sortint_arg;
   
@@ -73,13 +73,13 @@ void update_screen(struct sorted_interval **sortint_arg) {
     }
     for(i = 0; i < sortint->num_pids; i++) {
       index = sortint->pid_indices[i];
-      process = get_interval_process_info(results->interval->pids[index]);
-      if(!process) continue;
+      name = output_snapshot->proc_names[index];
+      if(!name) continue;
       if(!get_interval_proc_num_samples(index)) continue;
-      sortint->pids[i] = results->interval->pids[index];
+      sortint->pids[i] = output_snapshot->interval->pids[index];
       sortint->proc_names[i] = realloc(sortint->proc_names[i],
-                                       sizeof(char) * (strlen(process->name) + 1));
-      strcpy(sortint->proc_names[i], process->name);
+                                       sizeof(char) * (strlen(name) + 1));
+      strcpy(sortint->proc_names[i], name);
     }
     
     
@@ -90,7 +90,13 @@ void update_screen(struct sorted_interval **sortint_arg) {
                                     HEADER
   ****************************************************************************/
   printf("\n");
-  printf("%-*s %-*s", pid_col_width, "PID", name_col_width, "NAME");
+  if(pw_opts.group_by == GROUP_BY_CGROUP) {
+    printf("%-*s %-*s", pid_col_width, "PROCS", name_col_width, "CGROUP");
+  } else if(pw_opts.threads) {
+    printf("%-*s %-*s", pid_col_width, "TID", name_col_width, "NAME");
+  } else {
+    printf("%-*s %-*s", pid_col_width, "PID", name_col_width, "NAME");
+  }
   if(pw_opts.debug) {
     /* Only print debug stuff */
     printf(" %-*.*s", col_width, col_width, "%ERROR");
@@ -106,6 +112,12 @@ void update_screen(struct sorted_interval **sortint_arg) {
   }
   printf(" %-*.*s", col_width, col_width, "%TOTAL");
   printf(" %-*.*s", col_width, col_width, "TOTAL");
+  
+  /* Samples that the BPF program couldn't record. These are
+     only known per-CPU, not per-process. */
+  printf(" %-*.*s", col_width, col_width, "%LOST");
+  printf(" %-*.*s", col_width, col_width, "%NOFETCH");
+  printf(" %-*.*s", col_width, col_width, "%KERNEL");
   printf("\n");
   
   /****************************************************************************
@@ -125,15 +137,130 @@ void update_screen(struct sorted_interval **sortint_arg) {
     }
   }
   printf(" %-*.*lf", col_width, 2, 100.0);
-  printf(" %-*.*" PRIu64, col_width, 2, get_interval_num_samples());
+  printf(" %-*.*" PRIu64, col_width, 2, get_interval_scaled_samples());
+  printf(" %-*.*lf", col_width, 2, get_lost_percent(-1));
+  printf(" %-*.*lf", col_width, 2, get_fetch_failed_percent(-1));
+  printf(" %-*.*lf", col_width, 2, get_kernel_percent(-1));
   printf("\n");
+  
+  /* In debug mode, show how well the decode cache is doing */
+  if(pw_opts.debug) {
+    printf("%-*s ", pid_col_width, "CACHE");
+    printf("%-*s", name_col_width, "HIT%/MS SAVED");
+    printf(" %-*.*lf", col_width, 2, get_interval_cache_hit_percent());
+    printf(" %-*.*lf", col_width, 2, get_interval_decode_ms_saved());
+    printf("\n");
+  }
+  
+  /* In debug mode, show each CPU that lost samples, so that
+     we can tell if a busy CPU is under-represented */
+  if(pw_opts.debug) {
+    for(i = 0; i < bpf_info->nr_cpus; i++) {
+      if(!cpu_had_losses(i)) continue;
+      printf("%-*s ", pid_col_width, "CPU");
+      printf("%-*d", name_col_width, i);
+      printf(" %-*.*s", col_width, col_width, "N/A");
+      printf(" %-*.*s", col_width, col_width, "N/A");
+      printf(" %-*.*s", col_width, col_width, "N/A");
+      printf(" %-*.*" PRIu64, col_width, 2, get_cpu_samples(i));
+      printf(" %-*.*lf", col_width, 2, get_lost_percent(i));
+      printf(" %-*.*lf", col_width, 2, get_fetch_failed_percent(i));
+      printf(" %-*.*lf", col_width, 2, get_kernel_percent(i));
+      printf("\n");
+    }
+  }
+  
+  /* In debug mode, show the sampling period, which can change each interval */
+  if(pw_opts.debug) {
+    printf("%-*s ", pid_col_width, "PERIOD");
+    printf("%-*s", name_col_width, "INSTRUCTIONS");
+    printf(" %-*" PRIu64, col_width, get_interval_sample_period());
+    printf("\n");
+  }
+  
+  /* In debug mode, show how much of the interval the duty cycle sampled */
+  if(pw_opts.debug && duty_cycle_enabled()) {
+    printf("%-*s ", pid_col_width, "DUTY");
+    printf("%-*s", name_col_width, "% ENABLED");
+    printf(" %-*.*lf", col_width, 2, get_interval_duty_percent());
+    printf("\n");
+  }
+  
+  /* In debug mode, show how many processes we're remembering */
+  if(pw_opts.debug) {
+    printf("%-*s ", pid_col_width, "PROCS");
+    printf("%-*s", name_col_width, "TRACKED/EXITS LOST");
+    printf(" %-*" PRIu64, col_width, get_interval_num_procs());
+    printf(" %-*" PRIu64, col_width, get_interval_lost_exits());
+    printf("\n");
+  }
+  
+  /* In debug mode, show how long it took to attach to every CPU,
+     and how many CPUs are attached now */
+  if(pw_opts.debug) {
+    printf("%-*s ", pid_col_width, "ATTACH");
+    printf("%-*s", name_col_width, "MS");
+    printf(" %-*.*lf", col_width, 2, get_attach_ms());
+    printf("\n");
+    printf("%-*s ", pid_col_width, "CPUS");
+    printf("%-*s", name_col_width, "ATTACHED");
+    printf(" %-*d", col_width, get_interval_num_cpus_attached());
+    printf("\n");
+  }
+  
+  /* In debug mode, show how long our own threads ran on the CPUs
+     that we sample, and how long they ran overall */
+  if(pw_opts.debug && bpf_info->self_time_link) {
+    printf("%-*s ", pid_col_width, "SELF MS");
+    printf("%-*s", name_col_width, "SAMPLED CPUS");
+    printf(" %-*.*lf", col_width, 2, get_interval_self_ms_sampled());
+    printf("\n");
+    printf("%-*s ", pid_col_width, "SELF MS");
+    printf("%-*s", name_col_width, "ALL CPUS");
+    printf(" %-*.*lf", col_width, 2, get_interval_self_ms());
+    printf("\n");
+  }
+  
+  /* In debug mode, show how big the ringbuffer ended up being */
+  if(pw_opts.debug) {
+    printf("%-*s ", pid_col_width, "RINGBUF");
+    printf("%-*s", name_col_width, "SIZE (KB)");
+    printf(" %-*" PRIu64, col_width, get_rb_size_kb());
+    printf("\n");
+  }
+  
+  /* In debug mode, show how many intervals the output has dropped */
+  if(pw_opts.debug) {
+    printf("%-*s ", pid_col_width, "OUTPUT");
+    printf("%-*s", name_col_width, "DROPPED");
+    printf(" %-*" PRIu64, col_width, get_interval_dropped());
+    printf("\n");
+  }
+  
+  /* In debug mode, show how full each ringbuffer shard is */
+  if(pw_opts.debug && (bpf_info->num_rb_shards > 1)) {
+    for(i = 0; i < bpf_info->num_rb_shards; i++) {
+      printf("%-*s ", pid_col_width, "SHARD");
+      printf("%-*d", name_col_width, i);
+      printf(" %-*.*s", col_width, col_width, "N/A");
+      printf(" %-*.*lf", col_width, 2, get_interval_shard_ringbuf_used(i));
+      printf("\n");
+    }
+  }
 
   /****************************************************************************
                                     PER-PID
   ****************************************************************************/
   for(i = 0; i < sortint->num_pids; i++) {
     printf("%-*d ", pid_col_width, sortint->pids[i]);
-    printf("%-*.*s", name_col_width, name_col_width, sortint->proc_names[i]);
+    name = sortint->proc_names[i];
+    if(((pw_opts.group_by == GROUP_BY_CGROUP) || pw_opts.threads) &&
+       name && (strlen(name) > name_col_width)) {
+      /* The end of a cgroup's path, or a thread's name, is the part
+         that tells them apart */
+      name += strlen(name) - name_col_width;
+    }
+    printf("%-*.*s", name_col_width, name_col_width, name);
     if(pw_opts.debug) {
       printf(" %-*.*lf", col_width, 2, get_interval_proc_percent_failed(sortint->pid_indices[i]));
       printf(" %-*.*s", col_width, col_width, "N/A");
@@ -146,7 +273,7 @@ void update_screen(struct sorted_interval **sortint_arg) {
       }
     }
     printf(" %-*.*lf", col_width, 2, get_interval_proc_percent_samples(sortint->pid_indices[i]));
-    printf(" %-*.*" PRIu64, col_width, 2, get_interval_proc_num_samples(sortint->pid_indices[i]));
+    printf(" %-*.*" PRIu64, col_width, 2, get_interval_proc_scaled_samples(sortint->pid_indices[i]));
     printf("\n");
   }
 }
@@ -4,23 +4,144 @@
 #pragma once
 
 double get_interval_ringbuf_used() {
-  return results->interval->ringbuf_used;
+  return output_snapshot->interval->ringbuf_used;
 }
 
-double get_interval_proc_percent_samples(int proc_index) {
-  return results->interval->proc_percent[proc_index];
+double get_interval_shard_ringbuf_used(int shard) {
+  return output_snapshot->interval->shard_ringbuf_used[shard];
 }
 
-double get_interval_proc_percent_failed(int proc_index) {
-  return results->interval->proc_failed_percent[proc_index];
+uint64_t get_interval_proc_num_samples(int proc_index) {
+  return output_snapshot->interval->procs[proc_index]->num_samples;
 }
 
-uint64_t get_interval_proc_num_samples(int proc_index) {
-  return results->interval->proc_num_samples[proc_index];
+/**
+  get_*_percent: Of the samples that the BPF program saw (on one CPU, or
+  on all of them), the percentage that it couldn't record. `lost` ones had
+  no room to go; `fetch_failed` ones had an unreadable instruction; `kernel`
+  ones were in the kernel, which we don't profile.
+**/
+static struct insn_stats *get_stats(int cpu) {
+  if(cpu < 0) {
+    return &(output_snapshot->interval->stats);
+  }
+  return &(output_snapshot->interval->cpu_stats[cpu]);
+}
+
+#define stats_percent(stats, field) \
+  ((stats)->samples ? ((double) (stats)->field) / (stats)->samples * 100 : 0)
+
+double get_lost_percent(int cpu) {
+  return stats_percent(get_stats(cpu), lost);
+}
+
+double get_fetch_failed_percent(int cpu) {
+  return stats_percent(get_stats(cpu), fetch_failed);
+}
+
+double get_kernel_percent(int cpu) {
+  return stats_percent(get_stats(cpu), kernel);
+}
+
+uint64_t get_cpu_samples(int cpu) {
+  return get_stats(cpu)->samples;
+}
+
+/**
+  cpu_had_losses: Whether any of the CPU's samples were lost or unreadable.
+**/
+int cpu_had_losses(int cpu) {
+  return get_stats(cpu)->lost || get_stats(cpu)->fetch_failed;
+}
+
+uint64_t get_interval_sample_period() {
+  return output_snapshot->interval->sample_period;
+}
+
+uint64_t get_interval_num_procs() {
+  return output_snapshot->num_procs;
+}
+
+/* Processes whose exits couldn't be sent are only forgotten once their PID is reused */
+uint64_t get_interval_lost_exits() {
+  return output_snapshot->interval->stats.lost_exits;
+}
+
+int get_interval_num_cpus_attached() {
+  return output_snapshot->interval->num_cpus_attached;
+}
+
+uint64_t get_interval_dropped() {
+  return output_snapshot->dropped;
+}
+
+/* How long our own threads ran, on the CPUs that we sample and overall */
+double get_interval_self_ms_sampled() {
+  uint64_t ns;
+  int cpu;
+  
+  ns = 0;
+  for(cpu = 0; cpu < bpf_info->nr_cpus; cpu++) {
+    if(cpu_is_wanted(cpu)) {
+      ns += output_snapshot->interval->cpu_stats[cpu].self_ns;
+    }
+  }
+  return ns / 1000000.0;
+}
+
+double get_interval_self_ms() {
+  return output_snapshot->interval->stats.self_ns / 1000000.0;
+}
+
+double get_attach_ms() {
+  return bpf_info->attach_ns / 1000000.0;
+}
+
+/* The ringbuffer's size doesn't change after it's loaded */
+uint64_t get_rb_size_kb() {
+  return bpf_info->rb_size / 1024;
 }
 
 uint64_t get_interval_num_samples() {
-  return results->interval->num_samples;
+  return output_snapshot->interval->num_samples;
+}
+
+/* With a duty cycle, sample counts are estimates of what
+   we'd have seen if we had sampled the whole interval */
+uint64_t get_interval_scaled_samples() {
+  return output_snapshot->interval->num_samples * output_snapshot->interval->duty_scale;
+}
+
+uint64_t get_interval_proc_scaled_samples(int proc_index) {
+  return output_snapshot->interval->procs[proc_index]->num_samples *
+         output_snapshot->interval->duty_scale;
+}
+
+double get_interval_duty_percent() {
+  return 100.0 / output_snapshot->interval->duty_scale;
+}
+
+double get_interval_cache_hit_percent() {
+  uint64_t lookups;
+  
+  lookups = output_snapshot->interval->cache_hits + output_snapshot->interval->cache_misses;
+  if(!lookups) {
+    return 0;
+  }
+  return ((double) output_snapshot->interval->cache_hits) / lookups * 100;
+}
+
+/**
+  get_interval_decode_ms_saved: Estimates the time that the decode cache
+  saved this interval, assuming that each hit would have cost as much as
+  the average miss.
+**/
+double get_interval_decode_ms_saved() {
+  if(!(output_snapshot->interval->cache_misses)) {
+    return 0;
+  }
+  return ((double) output_snapshot->interval->decode_ns) / output_snapshot->interval->cache_misses *
+         output_snapshot->interval->cache_hits / 1000000;
 }
 
 const char *get_name(int index) {
@@ -45,32 +166,66 @@ const char *get_name(int index) {
 
 }
 
+/**
+  get_interval_count_percent: `count` as a percentage of all
+  of this interval's samples.
+**/
+double get_interval_count_percent(uint64_t count) {
+  if(!(output_snapshot->interval->num_samples)) {
+    return 0;
+  }
+  return ((double) count) / output_snapshot->interval->num_samples * 100;
+}
+
+double get_interval_proc_percent_samples(int proc_index) {
+  return get_interval_count_percent(output_snapshot->interval->procs[proc_index]->num_samples);
+}
+
+double get_interval_proc_percent_failed(int proc_index) {
+  return get_interval_count_percent(output_snapshot->interval->procs[proc_index]->num_failed);
+}
+
 double get_interval_percent(int index) {
   if(pw_opts.show_mnemonics) {
-    return results->interval->insn_percent[index];
+    return get_interval_count_percent(output_snapshot->interval->insn_count[index]);
 #ifdef __x86_64__
   } else if(pw_opts.show_extensions) {
-    return results->interval->ext_percent[index];
+    return get_interval_count_percent(output_snapshot->interval->ext_count[index]);
 #endif
   } else {
-    return results->interval->cat_percent[index];
+    return get_interval_count_percent(output_snapshot->interval->cat_count[index]);
   }
 }
 
 double get_interval_failed_percent() {
-  return results->interval->failed_percent;
+  return get_interval_count_percent(output_snapshot->interval->num_failed);
 }
 
+/**
+  get_interval_proc_percent: The percentage of a process's samples
+  that were in the given mnemonic, extension or category. Computed
+  from the process's counter block when it's displayed.
+**/
 double get_interval_proc_percent(int proc_index, int index) {
+  proc_counts_t *proc;
+  uint64_t count;
+  
+  proc = output_snapshot->interval->procs[proc_index];
+  if(!(proc->num_samples)) {
+    return 0;
+  }
+  
   if(pw_opts.show_mnemonics) {
-    return results->interval->proc_insn_percent[index][proc_index];
+    count = get_proc_insn_count(proc, index);
 #ifdef __x86_64__
   } else if(pw_opts.show_extensions) {
-    return results->interval->proc_ext_percent[index][proc_index];
+    count = proc->ext_count[index];
 #endif
   } else {
-    return results->interval->proc_cat_percent[index][proc_index];
+    count = proc->cat_count[index];
   }
+  
+  return ((double) count) / proc->num_samples * 100;
 }
 
 enum qsort_val_type {
@@ -95,19 +250,19 @@ enum qsort_val_type {
 #define get_value(val, val_type, set) \
   switch(val_type) { \
     case QSORT_INTERVAL_PID: \
-      set = results->interval->proc_num_samples[val]; \
+      set = output_snapshot->interval->procs[val]->num_samples; \
       break; \
     case QSORT_INTERVAL_CAT_COUNT: \
-      set = results->interval->cat_count[val]; \
+      set = output_snapshot->interval->cat_count[val]; \
       break; \
     case QSORT_INTERVAL_CAT_PERCENT: \
-      set = results->interval->cat_percent[val]; \
+      set = get_interval_count_percent(output_snapshot->interval->cat_count[val]); \
       break; \
     case QSORT_INTERVAL_INSN_COUNT: \
-      set = results->interval->insn_count[val]; \
+      set = output_snapshot->interval->insn_count[val]; \
       break; \
     case QSORT_INTERVAL_INSN_PERCENT: \
-      set = results->interval->insn_percent[val]; \
+      set = get_interval_count_percent(output_snapshot->interval->insn_count[val]); \
       break; \
     default: \
       fprintf(stderr, "Invalid val_type! Aborting.\n"); \
@@ -120,25 +275,25 @@ enum qsort_val_type {
 #define get_value(val, val_type, set) \
   switch(val_type) { \
     case QSORT_INTERVAL_PID: \
-      set = results->interval->proc_num_samples[val]; \
+      set = output_snapshot->interval->procs[val]->num_samples; \
       break; \
     case QSORT_INTERVAL_CAT_COUNT: \
-      set = results->interval->cat_count[val]; \
+      set = output_snapshot->interval->cat_count[val]; \
       break; \
     case QSORT_INTERVAL_CAT_PERCENT: \
-      set = results->interval->cat_percent[val]; \
+      set = get_interval_count_percent(output_snapshot->interval->cat_count[val]); \
       break; \
     case QSORT_INTERVAL_EXT_COUNT: \
-      set = results->interval->ext_count[val]; \
+      set = output_snapshot->interval->ext_count[val]; \
       break; \
     case QSORT_INTERVAL_EXT_PERCENT: \
-      set = results->interval->ext_percent[val]; \
+      set = get_interval_count_percent(output_snapshot->interval->ext_count[val]); \
       break; \
     case QSORT_INTERVAL_INSN_COUNT: \
-      set = results->interval->insn_count[val]; \
+      set = output_snapshot->interval->insn_count[val]; \
       break; \
     case QSORT_INTERVAL_INSN_PERCENT: \
-      set = results->interval->insn_percent[val]; \
+      set = get_interval_count_percent(output_snapshot->interval->insn_count[val]); \
       break; \
     default: \
       fprintf(stderr, "Invalid val_type! Aborting.\n"); \
@@ -239,7 +394,7 @@ void quicksort(int *vals, int val_type, int low, int high) {
 int *sort_interval_pids(int *num_pids) {
   int *pids, i, num_procs;
   
-  num_procs = results->interval->pid_ctr;
+  num_procs = output_snapshot->interval->pid_ctr;
   
   /* Copy all the PIDs into an array, unsorted. */
   pids = calloc(num_procs, sizeof(int));
@@ -277,60 +432,3 @@ int *sort_pids(int *num_pids) {
   *num_pids = num_procs;
   return pids;
 }
-
-/**
-  calculate_interval_percentages
-  **
-  For each instruction category and mnemonic, calculate:
-  1. Systemwide percentages.
-  2. Per-process percentages.
-**/
-void calculate_interval_percentages() {
-  int i, n;
-  
-  if(!(results->interval->num_samples)) {
-    return;
-  }
-  
-  results->interval->failed_percent = ((double) results->interval->num_failed) /
-                                                results->interval->num_samples * 100;
-  
-  for(i = 0; i < results->interval->proc_arr_size; i++) {
-    results->interval->proc_percent[i] = ((double) results->interval->proc_num_samples[i]) /
-                                                   results->interval->num_samples * 100;
-    results->interval->proc_failed_percent[i] = ((double) results->interval->proc_num_failed[i]) /
-                                                   results->interval->num_samples * 100;
-  }
-  
-  for(i = 0; i <= CATEGORY_MAX_VALUE; i++) {
-    results->interval->cat_percent[i] = ((double) results->interval->cat_count[i]) /
-                                                  results->interval->num_samples * 100;
-    for(n = 0; n < results->interval->proc_arr_size; n++) {
-      if(!(results->interval->proc_num_samples[n])) continue;
-      results->interval->proc_cat_percent[i][n] = ((double) results->interval->proc_cat_count[i][n]) /
-                                                            results->interval->proc_num_samples[n] * 100;
-    }
-  }
-  
-  for(i = 0; i <= MNEMONIC_MAX_VALUE; i++) {
-    results->interval->insn_percent[i] = ((double) results->interval->insn_count[i]) /
-                                                   results->interval->num_samples * 100;
-    for(n = 0; n < results->interval->proc_arr_size; n++) {
-      if(!(results->interval->proc_num_samples[n])) continue;
-      results->interval->proc_insn_percent[i][n] = ((double) results->interval->proc_insn_count[i][n]) /
-                                                             results->interval->proc_num_samples[n] * 100;
-    }
-  }
-  
-#ifdef __x86_64__
-  for(i = 0; i <= EXTENSION_MAX_VALUE; i++) {
-    results->interval->ext_percent[i] = ((double) results->interval->ext_count[i]) /
-                                                  results->interval->num_samples * 100;
-    for(n = 0; n < results->interval->proc_arr_size; n++) {
-      if(!(results->interval->proc_num_samples[n])) continue;
-      results->interval->proc_ext_percent[i][n] = ((double) results->interval->proc_ext_count[i][n]) /
-                                                            results->interval->proc_num_samples[n] * 100;
-    }
-  }
-#endif
-}